@@ -31,6 +31,11 @@
 #include "dircopy/backup.hpp"
 #include "dircopy/validate.hpp"
 #include "dircopy/mount.hpp"
+#include "dircopy/schedule.hpp"
+#include "dircopy/diff.hpp"
+#include "dircopy/analyze.hpp"
+#include "dircopy/mark.hpp"
+#include "dircopy/journal.hpp"
 #include "dircopy/diagnose.hpp"
 
 #include "blocksync/sync.hpp"
@@ -155,14 +160,19 @@ template < typename T > struct tag_t { using type = T; };
 int cli(int argc, char* argv[])
 {
     bool vss = false, recursive = true, storage_server = false, scope = false;
-    string path = "", snapshot = "", host = "", image = "", action = "backup", skey = "", dest = "", json = "", sdomain = "", password = "", description = "";
+    string path = "", snapshot = "", host = "", image = "", action = "backup", skey = "", dest = "", json = "", sdomain = "", password = "", description = "", strata = "none", from = "", to = "", other_key = "";
     string hport = "8008", qport = "9009", rport = "1010", wport = "1111";
     size_t threads = 4;
     size_t files = 64;
     size_t net_buffer = 16;
     size_t max_memory = 128;
+    size_t cache_size = 4096;
+    size_t max_age = 0;
+    size_t samples = 4096;
+    size_t offset = 0, length = 4096;
+    double confidence = 0.99;
     bool validate = false, auto_clear_bad_state = false, disable_mapping = true, aux_hash = false, sequence = false, index = false, help = false, silent = false,
-        commit = false, repair = false, assess = false;
+        commit = false, repair = false, assess = false, locality = false, use_journal = false;
 
     size_t compression = 13;
     size_t block_grouping = 16;
@@ -171,7 +181,8 @@ int cli(int argc, char* argv[])
     auto cli = (
         option("-c", "--config").doc("Json configuration file") & value("json", json),
         option("-k", "--key").doc("The store key used to restore, mount or validate") & value("key", skey),
-        option("-a", "--action").doc("What action will be taken, backup, validate_deep, validate, delta, search, restore, fetch, enumerate, compare, sync, migrate, list, diagnose, latest") & value("action", action),
+        option("-ok", "--other_key").doc("The newer store key compared against --key by diff") & value("other key", other_key),
+        option("-a", "--action").doc("What action will be taken, backup, validate_deep, validate, validate_batch, validate_sample, validate_files, validate_many, analyze, mark, rebuild_state, watch, delta, search, restore, plan, fetch, read, ls, diff, enumerate, compare, sync, migrate, list, diagnose, latest") & value("action", action),
         option("-s", "--snapshot").doc("A path where snapshot databases are stored") & value("snapshot", snapshot),
         option("-i", "--image").doc("Path of the image: D:\\Backup") & value("image", image),
         option("-h", "--host").doc("Hostname or IP of  store: backup.com, 192.168.4.14") & value("host", host),
@@ -183,6 +194,15 @@ int cli(int argc, char* argv[])
         option("-t", "--threads").doc("Threads used to encode / decode") & value("threads", threads),
         option("-nb", "--netbuffer").doc("Size of the TCP socket buffer") & value("network buffer", net_buffer),
         option("-mm", "--maxmemory").doc("Limit memory that can be used as IO buffer") & value("max memory", max_memory),
+        option("-cs", "--cache_size").doc("Limit of the decoded folder database cache kept in the snapshot folder ( MB )") & value("cache size", cache_size),
+        option("-sn", "--samples").doc("Unique blocks deep validated by validate_sample") & value("samples", samples),
+        option("-cf", "--confidence").doc("Confidence of the corruption bound reported by validate_sample ( 0 - 1 )") & value("confidence", confidence),
+        option("-st", "--strata").doc("Stratify validate_sample by none, size or age") & value("strata", strata),
+        option("-of", "--offset").doc("Byte offset of the range returned by read") & value("offset", offset),
+        option("-ln", "--length").doc("Byte length of the range returned by read") & value("length", length),
+        option("-fr", "--from").doc("First point in time used by validate_many, analyze and mark") & value("from", from),
+        option("-to", "--to").doc("Last point in time used by validate_many, analyze and mark") & value("to", to),
+        option("-ma", "--max_age").doc("Skip blocks validated within this many hours, recorded in the snapshot folder ledger") & value("max age", max_age),
         option("-b", "--blockgroup").doc("Group size of identification query") & value("block_grouping", block_grouping),
         option("-m", "--compression").doc("Compression Level ( 0 - 19 )") & value("compression", compression),
         option("-f", "--files").doc("Files processed at a time") & value("threads", files),
@@ -196,10 +216,12 @@ int cli(int argc, char* argv[])
         option("-rd", "--repair_database").doc("Full block and database validation and repair. Use --commit to enable repairs to be commited.").set(repair),
         option("-rdq", "--repair_database_quick").doc("Perform basic database validation, use after crash to rollback incomplete transactions").set(assess),
         option("-co", "--commit").doc("Allow changes to be make to database during repair process").set(commit),
+        option("-lo", "--locality").doc("Restore blocks in store locality order").set(locality),
         option("-sq", "--sequence").doc("Validate Blocks that are read or restored").set(sequence),
         option("-dm", "--disable_mapping").doc("used buffered io instead of memory mapping").set(disable_mapping),
         option("-ah", "--aux_hash").doc("Use faster hash for slower hardware").set(aux_hash),
-        option("-ac", "--auto_clear_bad_state").doc("Recover with any errors from previous backup failures.").set(auto_clear_bad_state),
+        option("-ac", "--auto_clear_bad_state").doc("Recover with any errors from previous backup failures. Backups that kept a checkpoint are resumed instead.").set(auto_clear_bad_state),
+        option("-jn", "--journal").doc("Recursive backups only walk what the change journal of --action watch recorded ( Linux )").set(use_journal),
         option("-r", "--recursive").doc("Recursive enumeration of directories").set(recursive),
         option("-ph", "--httpport").doc("HTTP Port") & value("hport", hport),
         option("-pq", "--queryport").doc("Query Port") & value("qport", qport),
@@ -267,6 +289,7 @@ int cli(int argc, char* argv[])
                     {
                     case switch_t("vss"):   vss = value;    break;
                     case switch_t("key"):   skey = value;   break;
+                    case switch_t("other_key"):     other_key = value;      break;
                     case switch_t("host"):  host = value;   break;
                     case switch_t("path"):  path = value;   break;
                     case switch_t("files"):     files = value;      break;
@@ -279,7 +302,17 @@ int cli(int argc, char* argv[])
                     case switch_t("validate"):      validate = value;       break;
                     case switch_t("netbuffer"):     net_buffer = value;     break;
                     case switch_t("recursive"):     recursive = value;      break;
+                    case switch_t("journal"):       use_journal = value;    break;
                     case switch_t("blockgroup"):    block_grouping = value; break;
+                    case switch_t("cache_size"):    cache_size = value;     break;
+                    case switch_t("max_age"):       max_age = value;        break;
+                    case switch_t("samples"):       samples = value;        break;
+                    case switch_t("confidence"):    confidence = value;     break;
+                    case switch_t("strata"):        strata = value;         break;
+                    case switch_t("from"):          from = value;           break;
+                    case switch_t("offset"):        offset = value;         break;
+                    case switch_t("length"):        length = value;         break;
+                    case switch_t("to"):            to = value;             break;
                     case switch_t("destination"):   dest = value;           break;
                     case switch_t("compression"):   compression = value;    break;
                     }
@@ -294,7 +327,7 @@ int cli(int argc, char* argv[])
             {
                 if (auto_clear_bad_state)
                 {
-                    if (snapshot.size() && std::filesystem::exists(snapshot + "\\lock.db"))
+                    if (snapshot.size() && delta::Path<>::Stale(snapshot))
                     {
                         std::cout << "Clearing previous bad state ( see --auto_clear_bad_state )" << std::endl;
                         std::filesystem::remove_all(snapshot);
@@ -342,6 +375,32 @@ int cli(int argc, char* argv[])
                 return true;
             };
 
+            auto cache = (snapshot.size()) ? snapshot + "\\cache" : std::string();
+            auto cache_limit = (uint64_t)cache_size * 1024 * 1024;
+
+            auto ledger = (snapshot.size()) ? snapshot + "\\ledger.db" : std::string();
+            auto ledger_age = (uint64_t)max_age * 60 * 60;
+
+            //Several search or fetch targets are separated by ; in --path:
+            //
+
+            auto targets = [&]()
+            {
+                std::vector<std::string> result;
+
+                for (size_t start = 0; start <= path.size();)
+                {
+                    auto end = std::min(path.find(';', start), path.size());
+
+                    if (end > start)
+                        result.push_back(path.substr(start, end - start));
+
+                    start = end + 1;
+                }
+
+                return result;
+            };
+
             auto do_switch = [&](auto& store, auto _hash_t)
             {
                 using hash_t = typename decltype(_hash_t)::type;
@@ -351,12 +410,74 @@ int cli(int argc, char* argv[])
                 if (skey.size())
                     key = d8u::util::to_bin_t<hash_t>(skey);
 
+                //Keys are given comma separated with --key, or taken from the group between --from and --to:
+                //
+                auto snapshot_keys = [&]()
+                {
+                    std::vector<hash_t> keys;
+                    std::vector<std::string> labels;
+
+                    for (size_t start = 0; start < skey.size();)
+                    {
+                        auto end = skey.find(',', start);
+                        if (end == std::string::npos)
+                            end = skey.size();
+
+                        if (end > start)
+                        {
+                            keys.push_back(d8u::util::to_bin_t<hash_t>(skey.substr(start, end - start)));
+                            labels.push_back(skey.substr(start, end - start));
+                        }
+
+                        start = end + 1;
+                    }
+
+                    auto from_group = [&](auto& group)
+                    {
+                        group.EnumerateStream([&](const auto& point_in_time)
+                            {
+                                auto pit = std::string(point_in_time);
+
+                                if ((from.size() && pit < from) || (to.size() && pit > to))
+                                    return;
+
+                                auto element = group.GetElement(pit);
+                                auto field = element.find("\"key\"");
+
+                                if (field == std::string::npos)
+                                    return;
+
+                                auto begin = element.find('"', element.find(':', field) + 1);
+                                auto end = element.find('"', begin + 1);
+
+                                if (begin == std::string::npos || end == std::string::npos)
+                                    return;
+
+                                keys.push_back(d8u::util::to_bin_t<hash_t>(element.substr(begin + 1, end - begin - 1)));
+                                labels.push_back(pit);
+                            });
+                    };
+
+                    if (!keys.size() && password.size() && image.size() && snapshot.size())
+                    {
+                        kreg::LocalGroup group(snapshot + "\\group", password, image + "\\registry.db");
+                        from_group(group);
+                    }
+                    else if (!keys.size() && password.size() && host.size() && snapshot.size())
+                    {
+                        kreg::Group group(snapshot + "\\group", password, host + ":7007");
+                        from_group(group);
+                    }
+
+                    return std::make_pair(keys, labels);
+                };
+
                 switch (switch_t(action))
                 {
                 case switch_t("backup"):
                     if (auto_clear_bad_state)
                     {
-                        if (snapshot.size() && std::filesystem::exists(snapshot + "\\lock.db"))
+                        if (snapshot.size() && delta::Path<>::Stale(snapshot))
                         {
                             std::cout << "Clearing previous bad state ( see --auto_clear_bad_state )" << std::endl;
                             std::filesystem::remove_all(snapshot);
@@ -384,7 +505,16 @@ int cli(int argc, char* argv[])
                         }
                         else
                         {
-                            if (recursive)
+                            if (recursive && use_journal)
+                            {
+#ifdef __linux__
+                                std::cout << "Journal Directory Backup: " << path << "; State: " << snapshot << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+                                result = journal::journal_folder2<false, hash_t>(json, snapshot, _stats, path, store, on_file, domain, files, 1024 * 1024, threads, compression, block_grouping, 128 * 1024 * 1024, max_memory * 1024 * 1024, sequence, index);
+#else
+                                std::cout << "Change journal not available on non-linux platform." << std::endl;
+#endif
+                            }
+                            else if (recursive)
                             {
                                 std::cout << "Recursive Directory Backup: " << path << "; State: " << snapshot << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
                                 result = backup::recursive_folder2<false, hash_t>(json, snapshot, _stats, path, store, on_file, domain, files, 1024 * 1024, threads, compression, block_grouping, 128 * 1024 * 1024, "", 0, max_memory * 1024 * 1024, sequence, index);
@@ -418,7 +548,16 @@ int cli(int argc, char* argv[])
                         }
                         else
                         {
-                            if (recursive)
+                            if (recursive && use_journal)
+                            {
+#ifdef __linux__
+                                std::cout << "Journal Directory Backup: " << path << "; State: " << snapshot << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+                                result = journal::journal_folder2<true, hash_t>(json, snapshot, _stats, path, store, on_file, domain, files, 1024 * 1024, threads, compression, block_grouping, 128 * 1024 * 1024, max_memory * 1024 * 1024, sequence, index);
+#else
+                                std::cout << "Change journal not available on non-linux platform." << std::endl;
+#endif
+                            }
+                            else if (recursive)
                             {
                                 std::cout << "Recursive Directory Backup: " << path << "; State: " << snapshot << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
                                 result = backup::recursive_folder2<true, hash_t>(json, snapshot, _stats, path, store, on_file, domain, files, 1024 * 1024, threads, compression, block_grouping, 128 * 1024 * 1024, "", 0, max_memory * 1024 * 1024, sequence, index);
@@ -438,19 +577,141 @@ int cli(int argc, char* argv[])
 
                     std::cout << "Validate Directory: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
 
-                    if (validate::folder2<hash_t>(_stats, key, store, domain, 1024 * 1024, 128 * 1024 * 1024, threads, files))
+                    if (validate::folder2<hash_t>(_stats, key, store, domain, 1024 * 1024, 128 * 1024 * 1024, threads, files, ledger, ledger_age))
                         std::cout << "Validation Success" << std::endl;
                     else
                         std::cout << "Error Detected" << std::endl;
+
+                    std::cout << "Unique Blocks " << _stats.direct.blocks << ", Referenced " << _stats.direct.blocks + _stats.direct.dblocks << std::endl;
+
+                    if (ledger_age)
+                        std::cout << "Recently Validated " << _stats.direct.items << std::endl;
+                    break;
+                case switch_t("validate_batch"):
+
+                    std::cout << "Validate Directory Batched: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    if (validate::core_batch<hash_t>(_stats, key, store, domain, [&](auto index, auto& ids, auto bitmap)
+                        {
+                            if (bitmap.count() == ids.size())
+                                return;
+
+                            for (size_t i = 0; i < ids.size(); i++)
+                            {
+                                if (!bitmap[i])
+                                    std::cout << "Batch " << index << " Missing " << d8u::util::to_hex(ids[i]) << std::endl;
+                            }
+                        }, threads))
+                        std::cout << "Validation Success" << std::endl;
+                    else
+                        std::cout << "Error Detected" << std::endl;
+                    break;
+                case switch_t("validate_many"):
+                {
+                    auto [keys, labels] = snapshot_keys();
+
+                    std::cout << "Validate Snapshots: " << keys.size() << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    std::mutex report;
+
+                    if (validate::many2<hash_t>(_stats, keys, store, domain, validate, [&](auto index, auto name)
+                        {
+                            std::lock_guard<std::mutex> guard(report);
+                            std::cout << "Corrupt " << labels[index] << " " << name << std::endl;
+                        }, threads))
+                        std::cout << std::endl << "Validation Success" << std::endl;
+                    else
+                        std::cout << std::endl << "Error Detected" << std::endl;
+
+                    std::cout << "Unique Blocks " << _stats.direct.blocks << ", Referenced " << _stats.direct.blocks + _stats.direct.dblocks << std::endl;
+                    break;
+                }
+                case switch_t("analyze"):
+                {
+                    auto [keys, labels] = snapshot_keys();
+
+                    std::cout << "Analyze Snapshots: " << keys.size() << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    analyze::core_churn<hash_t>(_stats, keys, store, domain, [&](auto index, auto& snapshot)
+                        {
+                            std::cout << labels[index] << ": Files " << snapshot.files << ", Referenced " << snapshot.referenced_bytes << " bytes, Unique " << snapshot.unique_bytes << " bytes, New " << snapshot.new_bytes << " bytes, Shared " << snapshot.shared_bytes << " bytes" << std::endl;
+
+                            for (auto& [directory, bytes] : snapshot.churn)
+                                std::cout << "    " << bytes << " new bytes in " << directory << std::endl;
+                        }, 10, 1024 * 1024, cache, cache_limit);
+                    break;
+                }
+                case switch_t("rebuild_state"):
+                {
+                    if (!snapshot.size())
+                        throw std::runtime_error("rebuild_state needs --snapshot");
+
+                    std::cout << "Rebuild Change Tracking: " << snapshot << " From: " << skey << std::endl << std::endl;
+
+                    auto tracked = backup::rebuild_state2(snapshot, _stats, key, store, domain, path, threads);
+
+                    std::cout << "Tracking " << tracked << " files, the next backup reads only files changed since this key" << std::endl;
+                    break;
+                }
+                case switch_t("mark"):
+                {
+                    auto [keys, labels] = snapshot_keys();
+
+                    std::cout << "Mark Snapshots: " << keys.size() << " Domain: " << d8u::util::to_hex(domain) << " Output: " << dest << std::endl << std::endl;
+
+                    auto [ok, marked] = mark::mark2<hash_t>(_stats, keys, store, domain, dest, threads, (uint64_t)max_memory * 1024 * 1024);
+
+                    if (ok)
+                        std::cout << "Files " << marked.files << ", Referenced " << marked.referenced << ", Live Blocks " << marked.live << std::endl << std::endl << "Mark Success" << std::endl;
+                    else
+                        std::cout << "Error Detected, no live set was written" << std::endl;
+                    break;
+                }
+                case switch_t("validate_files"):
+
+                    std::cout << "Validate Directory Files: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    if (validate::stream_folder2<hash_t>(_stats, key, store, domain, threads, files))
+                        std::cout << std::endl << "Validation Success" << std::endl;
+                    else
+                        std::cout << std::endl << "Error Detected" << std::endl;
                     break;
+                case switch_t("validate_sample"):
+                {
+                    std::cout << "Validate Directory Sample: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    auto by = (strata == "size") ? validate::Strata::size : (strata == "age") ? validate::Strata::age : validate::Strata::none;
+
+                    auto [ok, result] = validate::sample_folder2<hash_t>(_stats, key, store, domain, samples, confidence, by, 0, threads);
+
+                    for (size_t i = 0; result.strata.size() > 1 && i < result.strata.size(); i++)
+                    {
+                        auto& e = result.strata[i];
+                        std::cout << "Stratum " << i << ": Population " << e.population << ", Sampled " << e.sampled << ", Failed " << e.failed << ", Corrupt <= " << e.upper * 100 << "%" << std::endl;
+                    }
+
+                    std::cout << "Population " << result.total.population << ", Sampled " << result.total.sampled << ", Failed " << result.total.failed << std::endl;
+                    std::cout << "Corrupt <= " << result.total.upper * 100 << "% at " << confidence * 100 << "% confidence" << std::endl;
+
+                    if (ok)
+                        std::cout << std::endl << "Validation Success" << std::endl;
+                    else
+                        std::cout << std::endl << "Error Detected" << std::endl;
+                    break;
+                }
                 case switch_t("validate_deep"):
 
                     std::cout << "Validate Directory Deep: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
 
-                    if (validate::deep_folder2<hash_t>(_stats, key, store, domain, 1024 * 1024, 128 * 1024 * 1024, threads, files))
+                    if (validate::deep_folder2<hash_t>(_stats, key, store, domain, 1024 * 1024, 128 * 1024 * 1024, threads, files, ledger, ledger_age))
                         std::cout << std::endl << "Validation Success" << std::endl;
                     else
                         std::cout << std::endl << "Error Detected" << std::endl;
+
+                    std::cout << "Unique Blocks " << _stats.direct.blocks << ", Referenced " << _stats.direct.blocks + _stats.direct.dblocks << std::endl;
+
+                    if (ledger_age)
+                        std::cout << "Recently Validated " << _stats.direct.items << std::endl;
                     break;
                 case switch_t("delta"):
 
@@ -477,17 +738,34 @@ int cli(int argc, char* argv[])
                 {
                     std::cout << "Search: " << path << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
 
-                    mount::Path handle(key, store, domain, validate);
+                    mount::Path handle(key, store, domain, validate, cache, cache_limit);
 
                     running = false;
                     console.join();
 
-                    auto count = handle.Search(path, [&](auto size, auto time, auto name, auto keys)
-                        {
-                            std::cout << name << " " << size << " bytes " << time << " changed" << std::endl;
+                    size_t count = 0;
 
-                            return true;
-                        });
+                    if (path.find(';') != std::string::npos)
+                    {
+                        //Several targets separated by ; are matched in one scan:
+                        //
+
+                        auto list = targets();
+
+                        count = handle.Search(list, [&](auto index, auto size, auto time, auto name, auto keys)
+                            {
+                                std::cout << list[index] << ": " << name << " " << size << " bytes " << time << " changed" << std::endl;
+
+                                return true;
+                            });
+                    }
+                    else
+                        count = handle.Search(path, [&](auto size, auto time, auto name, auto keys)
+                            {
+                                std::cout << name << " " << size << " bytes " << time << " changed" << std::endl;
+
+                                return true;
+                            });
 
                     std::cout << "Found " << count << " files" << std::endl << std::endl;
 
@@ -500,28 +778,95 @@ int cli(int argc, char* argv[])
 
                     std::filesystem::create_directories(path);
 
-                    restore::folder2(_stats, path, key, store, domain, validate, validate, 1024 * 1024, 128 * 1024 * 1024, threads, files);
+                    if (locality)
+                        schedule::folder2(_stats, path, key, store, domain, validate, validate, 1024 * 1024, threads, 64 * 1024, cache, cache_limit);
+                    else
+                        restore::folder2(_stats, path, key, store, domain, validate, validate, 1024 * 1024, 128 * 1024 * 1024, threads, files, cache, cache_limit);
+
+                    break;
+                case switch_t("plan"):
+
+                    std::cout << "Restore Plan: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
+
+                    schedule::profile(_stats, key, store, domain, validate, 1024 * 1024, 64 * 1024, cache, cache_limit);
 
                     break;
                 case switch_t("fetch"):
                 {
                     std::cout << "Fetch: " << path << " >> " << dest << "; Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
 
-                    mount::Path handle(key, store, domain, validate);
+                    mount::Path handle(key, store, domain, validate, cache, cache_limit);
 
                     running = false;
                     console.join();
 
-                    handle.Fetch(path, dest, threads);
+                    if (path.find_first_of(";*?") != std::string::npos || (path.size() && (path.back() == '\\' || path.back() == '/')))
+                    {
+                        //Several targets separated by ; are fetched into the destination folder with one block schedule:
+                        //
+
+                        auto list = targets();
+
+                        std::cout << "Fetched " << handle.Fetch(list, dest, threads) << " files" << std::endl;
+                    }
+                    else
+                        handle.Fetch(path, dest, threads);
 
                     handle.PrintUsage();
                 }
                 break;
+                case switch_t("diff"):
+                {
+                    running = false;
+                    console.join();
+
+                    diff::json<hash_t>(_stats, std::cout, key, d8u::util::to_bin_t<hash_t>(other_key), store, domain, false, 1024 * 1024, cache, cache_limit);
+                }
+                break;
+                case switch_t("ls"):
+                {
+                    mount::Path handle(key, store, domain, validate, cache, cache_limit);
+
+                    running = false;
+                    console.join();
+
+                    auto indexed = handle.List(path, [&](auto name, auto directory, auto size, auto time)
+                        {
+                            if (directory)
+                                std::cout << name << "\\ " << size << " bytes" << std::endl;
+                            else
+                                std::cout << name << " " << size << " bytes " << time << " changed" << std::endl;
+
+                            return true;
+                        });
+
+                    if (!indexed)
+                        std::cout << "Directory not found in the index: " << path << std::endl;
+                }
+                break;
+                case switch_t("read"):
+                {
+                    mount::Path handle(key, store, domain, validate, cache, cache_limit);
+
+                    running = false;
+                    console.join();
+
+                    auto range = handle.Read(path, offset, length);
+
+                    if (dest.size())
+                    {
+                        std::ofstream output(dest, std::ios::binary);
+                        output.write((const char*)range.data(), range.size());
+                    }
+                    else
+                        std::cout.write((const char*)range.data(), range.size());
+                }
+                break;
                 case switch_t("enumerate"):
                 {
                     std::cout << "Enumerate: " << " Domain: " << d8u::util::to_hex(domain) << std::endl << std::endl;
 
-                    mount::Path handle(key, store, domain, validate);
+                    mount::Path handle(key, store, domain, validate, cache, cache_limit);
 
                     running = false;
                     console.join();
@@ -552,6 +897,20 @@ int cli(int argc, char* argv[])
 
                 switch (switch_t(action))
                 {
+                case switch_t("watch"):
+                {
+#ifdef __linux__
+                    journal::Watcher watcher(path, snapshot);
+
+                    std::cout << "Change Journal: " << path << "; State: " << snapshot << "; Watching " << watcher.Watches() << " directories" << std::endl;
+
+                    std::atomic<bool> watching = true;
+                    watcher.Run(watching);
+#else
+                    std::cout << "Change journal not available on non-linux platform." << std::endl;
+#endif
+                }
+                break;
                 case switch_t("rng_validate"):
                 {
                     std::filesystem::create_directories(snapshot);
@@ -846,13 +1205,24 @@ int cli(int argc, char* argv[])
                         write = host + ":" + wport;
                         break;
                     case switch_t("fetch"):
+                    case switch_t("read"):
+                    case switch_t("ls"):
+                    case switch_t("diff"):
+                    case switch_t("analyze"):
+                    case switch_t("mark"):
+                    case switch_t("rebuild_state"):
                     case switch_t("enumerate"):
                     case switch_t("search"):
                     case switch_t("validate_deep"):
+                    case switch_t("validate_sample"):
+                    case switch_t("validate_files"):
                     case switch_t("restore"):
+                    case switch_t("plan"):
                         read = host + ":" + rport;
                         break;
                     case switch_t("validate"):
+                    case switch_t("validate_batch"):
+                    case switch_t("validate_many"):
                         query = host + ":" + qport;
                         read = host + ":" + rport;
                         break;
@@ -860,7 +1230,7 @@ int cli(int argc, char* argv[])
 
                     if (auto_clear_bad_state)
                     {
-                        if (snapshot.size() && std::filesystem::exists(snapshot + "\\lock.db"))
+                        if (snapshot.size() && delta::Path<>::Stale(snapshot))
                         {
                             std::cout << "Clearing previous bad state ( see --auto_clear_bad_state )" << std::endl;
                             std::filesystem::remove_all(snapshot);
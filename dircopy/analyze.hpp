@@ -0,0 +1,176 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+#include "d8u/transform.hpp"
+#include "d8u/util.hpp"
+
+#include "defs.hpp"
+#include "delta.hpp"
+#include "restore.hpp"
+
+namespace dircopy
+{
+	namespace analyze
+	{
+		using namespace defs;
+		using namespace d8u::util;
+		using namespace d8u::transform;
+
+		struct Snapshot
+		{
+			uint64_t files = 0;
+
+			uint64_t referenced_bytes = 0;
+			uint64_t unique_bytes = 0;
+			uint64_t new_bytes = 0;
+			uint64_t shared_bytes = 0;
+
+			uint64_t blocks = 0;
+			uint64_t unique_blocks = 0;
+			uint64_t new_blocks = 0;
+
+			std::vector<std::pair<std::string, uint64_t>> churn; //Directories by new bytes, largest first
+		};
+
+		//Walks snapshots oldest first, only folder records and key lists are read.
+		//Blocks are tracked by the first 8 bytes of their id in one sorted array, a block is new when no earlier snapshot referenced it.
+		//f(index, snapshot) is called as each snapshot completes.
+		//
+
+		template <typename TH, typename S, typename D, typename F> std::vector<Snapshot> core_churn(Statistics& s, const std::vector<TH>& folder_keys, S& store, const D& domain, F&& f, size_t TOP = 10, size_t BLOCK = 1024 * 1024, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			struct Reference
+			{
+				uint64_t id;
+				uint32_t bytes;
+				uint32_t directory;
+			};
+
+			std::vector<uint64_t> seen;
+			std::vector<Snapshot> result;
+
+			for (size_t n = 0; n < folder_keys.size(); n++)
+			{
+				restore::Database<TH> db(s, folder_keys[n], store, domain, true, true, 1, cache, CACHE);
+
+				Snapshot snapshot;
+
+				std::vector<Reference> references;
+				std::vector<std::string> directories;
+				std::unordered_map<std::string, uint32_t> directory_index;
+
+				db.Iterate([&](uint64_t p)
+				{
+					auto [size, time, name, keys] = db.Record(p);
+
+					if (!size || delta::Path<>::Internal(name))
+						return true;
+
+					auto parent = std::string(delta::Path<TH>::Parent(name));
+					auto [it, inserted] = directory_index.emplace(parent, (uint32_t)directories.size());
+
+					if (inserted)
+						directories.push_back(parent);
+
+					d8u::sse_vector list;
+
+					if (keys.size() == 1)
+					{
+						//The key list is a block of its own:
+						//
+
+						list = restore::list(s, *keys.data(), store, domain, true);
+
+						uint64_t id;
+						std::memcpy(&id, keys.data()->GetNext().data(), sizeof(id));
+						references.push_back(Reference{ id, (uint32_t)list.size(), it->second });
+
+						keys = span<TH>((TH*)list.data(), list.size() / sizeof(TH));
+					}
+
+					for (size_t i = 0; i + 1 < keys.size() /*Last hash is the file hash*/; i++)
+					{
+						uint64_t id;
+						std::memcpy(&id, keys[i].GetNext().data(), sizeof(id));
+
+						auto bytes = std::min<uint64_t>(BLOCK, size - std::min<uint64_t>(size, i * BLOCK));
+
+						references.push_back(Reference{ id, (uint32_t)bytes, it->second });
+					}
+
+					snapshot.files++;
+
+					return true;
+				});
+
+				for (auto& r : references)
+				{
+					snapshot.blocks++;
+					snapshot.referenced_bytes += r.bytes;
+				}
+
+				std::sort(references.begin(), references.end(), [](const auto& l, const auto& r) { return l.id < r.id; });
+				references.erase(std::unique(references.begin(), references.end(), [](const auto& l, const auto& r) { return l.id == r.id; }), references.end());
+
+				std::vector<uint64_t> fresh;
+				std::vector<uint64_t> churn(directories.size());
+
+				auto it = seen.begin();
+
+				for (auto& r : references)
+				{
+					snapshot.unique_blocks++;
+					snapshot.unique_bytes += r.bytes;
+
+					it = std::lower_bound(it, seen.end(), r.id);
+
+					if (it != seen.end() && *it == r.id)
+					{
+						snapshot.shared_bytes += r.bytes;
+						continue;
+					}
+
+					snapshot.new_blocks++;
+					snapshot.new_bytes += r.bytes;
+					churn[r.directory] += r.bytes;
+
+					fresh.push_back(r.id);
+				}
+
+				std::vector<uint64_t> merged;
+				merged.reserve(seen.size() + fresh.size());
+				std::merge(seen.begin(), seen.end(), fresh.begin(), fresh.end(), std::back_inserter(merged));
+				seen.swap(merged);
+
+				std::vector<size_t> order;
+
+				for (size_t i = 0; i < churn.size(); i++)
+				{
+					if (churn[i])
+						order.push_back(i);
+				}
+
+				auto top = std::min(TOP, order.size());
+
+				std::partial_sort(order.begin(), order.begin() + top, order.end(), [&](auto l, auto r) { return churn[l] > churn[r]; });
+
+				for (size_t i = 0; i < top; i++)
+					snapshot.churn.push_back(std::make_pair(directories[order[i]], churn[order[i]]));
+
+				f(n, snapshot);
+
+				result.push_back(std::move(snapshot));
+			}
+
+			return result;
+		}
+	}
+}
@@ -11,6 +11,8 @@
 
 #include <thread>
 #include <future>
+#include <memory>
+#include <atomic>
 #include <list>
 #include <tuple>
 #include <vector>
@@ -18,12 +20,14 @@
 #include <filesystem>
 #include <fstream>
 #include <bitset>
+#include <type_traits>
 
 #include "../mio.hpp"
 #include "../gsl-lite.hpp"
 
 #include "d8u/transform.hpp"
 #include "defs.hpp"
+#include "tree.hpp"
 
 #include "d8u/util.hpp"
 #include "d8u/memory.hpp"
@@ -31,6 +35,7 @@
 #include "search/engine.hpp"
 
 #include "delta.hpp"
+#include "restore.hpp"
 
 using gsl::span;
 
@@ -605,6 +610,22 @@ namespace dircopy
 		}
 
 
+		//Nodes of a key tree below its root, written like the key list itself. Used outside of pipelines, core_entries hands nodes to its block stages:
+		//
+		template < typename TH, typename STORE, typename D > TH tree_node(sse_vector& node, STORE& store, const D& domain, int compression)
+		{
+			TH key, id;
+			std::tie(key, id) = identify<TH>(domain, node);
+
+			if (!store.Is(id))
+			{
+				encode2<TH>(node, key, id, compression);
+				store.Write(id, node);
+			}
+
+			return key;
+		}
+
 		template < bool MMAP = true, typename TH, typename MAP, typename STORE, typename D> TH submit_core(Statistics& stats, const MAP& file, STORE& store, const D& domain = default_domain, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1,size_t MAX_MEMORY = 128*1024*1024,size_t sq = -1)
 		{
 			TH key, id;
@@ -623,6 +644,8 @@ namespace dircopy
 			//Identify as unique:
 			//
 
+			tree::Build<TH>(result, [&](auto& node) { return tree_node<TH>(node, store, domain, compression); });
+
 			std::tie(key, id) = identify<TH>(domain, result);
 
 			if (store.Is(id)) //TODO METADATA is not reported on this function
@@ -633,7 +656,7 @@ namespace dircopy
 
 			encode2<TH>(result, key, id,compression);
 
-			store.Write(id, result); //Files larger than 32 GB exceed 1MB of metadata, breaking the unenforced limit.
+			store.Write(id, result); //Past tree::FANOUT blocks this is the root of a key tree, nodes stay bounded.
 
 			return key;
 		}
@@ -865,8 +888,24 @@ namespace dircopy
 				std::this_thread::sleep_for(std::chrono::milliseconds(100));
 		}
 
-		template < bool MMAP = true, typename DITR, typename TH, typename STORE, typename ON_FILE, typename D > void core_folder(delta::Path<TH>& db, Statistics& stats, std::string_view path, STORE& store, ON_FILE&& on_file, const D& domain = default_domain, size_t FILES = 1, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1, size_t LARGE_THRESHOLD = 128 * 1024 * 1024, std::string_view drive = "", size_t rel_count = 0, size_t MAX_MEMORY = 128 * 1024 * 1024, bool use_sequence = false, bool index = false)
+		//Backs up the files of entries, anything iterating directory entries below path:
+		//
+		template < bool MMAP = true, typename TH, typename ENTRIES, typename STORE, typename ON_FILE, typename D > void core_entries(delta::Path<TH>& db, Statistics& stats, std::string_view path, ENTRIES&& entries, STORE& store, ON_FILE&& on_file, const D& domain = default_domain, size_t FILES = 1, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1, size_t LARGE_THRESHOLD = 128 * 1024 * 1024, size_t MAX_MEMORY = 128 * 1024 * 1024, bool use_sequence = false, bool index = false)
 		{
+			//Outstanding work of a changed file, its blocks and the applied record. The last to finish checkpoints the record:
+			//
+			struct Pending
+			{
+				Pending(std::string_view _rel, uint8_t* _queue)
+					: rel(_rel)
+					, queue(_queue) {}
+
+				std::atomic<size_t> count = 1;
+
+				std::string rel;
+				uint8_t* queue;
+			};
+
 			struct File
 			{
 				File() {}
@@ -887,6 +926,8 @@ namespace dircopy
 
 				uint8_t * queue;
 
+				std::shared_ptr<Pending> pending;
+
 				typename TH::State hash_state;
 			};
 
@@ -894,16 +935,25 @@ namespace dircopy
 			{
 				Block() {}
 
-				Block(sse_vector && _block, const TH& _key, const TH& _id, size_t _size)
+				Block(sse_vector && _block, const TH& _key, const TH& _id, size_t _size, const std::shared_ptr<Pending>& _pending = nullptr)
 					: buffer(std::move(_block))
 					, key(_key)
 					, id(_id)
-					, size(_size) {}
+					, size(_size)
+					, pending(_pending) {}
 
 				sse_vector buffer;
 				TH id;
 				TH key;
 				size_t size;
+
+				std::shared_ptr<Pending> pending;
+			};
+
+			auto done = [&](const std::shared_ptr<Pending>& pending)
+			{
+				if (pending && --pending->count == 0)
+					db.Checkpoint(pending->rel, pending->queue);
 			};
 
 			d8u::async::Pipeline<File,7> file_pipeline;
@@ -914,10 +964,30 @@ namespace dircopy
 
 			file_pipeline.Start([&](auto & prev,auto& next)
 			{
-				for (auto& e : DITR(path, std::filesystem::directory_options::skip_permission_denied))
+				using std::begin;
+				using std::end;
+
+				for (auto it = begin(entries), last = end(entries); it != last; ++it)
 				{
+					auto& e = *it;
+
 					if (e.is_directory())
+					{
+						//Subtrees excluded by a path rule are never walked:
+						//
+
+						if constexpr (std::is_same_v<decltype(it), std::filesystem::recursive_directory_iterator>)
+						{
+							try
+							{
+								if (db.Pruned(e.path().string().substr(path.size())))
+									it.disable_recursion_pending();
+							}
+							catch (...) {}
+						}
+
 						continue;
+					}
 
 					stats.atomic.items++;
 
@@ -959,11 +1029,16 @@ namespace dircopy
 					return false;
 
 				if (!file.size)
+				{
 					db.Apply(file.rel, file.size, file.change_time, sse_vector(), file.queue);
+					db.Checkpoint(file.rel, file.queue);
+				}
 				else
 				{
 					stats.atomic.files++;
 
+					file.pending = std::make_shared<Pending>(file.rel, file.queue);
+
 					next.Push(std::move(file),look_ahead);
 				}
 
@@ -1034,7 +1109,9 @@ namespace dircopy
 
 					stats.atomic.threads--;
 
-					block_pipeline.Push(Block(std::move(block), result_keys[dx++],id,block.size()));
+					file.pending->count++;
+
+					block_pipeline.Push(Block(std::move(block), result_keys[dx++],id,block.size(),file.pending));
 				}
 
 				stats.atomic.files--;
@@ -1082,6 +1159,8 @@ namespace dircopy
 
 						pool[cur].buffer.clear();
 
+						done(pool[cur].pending);
+
 						break;
 					case 0: //Don't know, ask again in batch
 
@@ -1136,6 +1215,8 @@ namespace dircopy
 								stats.atomic.memory -= pool[i].buffer.size();
 
 								pool[i].buffer.clear();
+
+								done(pool[i].pending);
 							}
 							else
 								block_pipeline.Push(std::move(pool[i]), 1);
@@ -1176,6 +1257,8 @@ namespace dircopy
 
 				stats.atomic.connections--;
 
+				done(block.pending);
+
 				return true;
 			});
 
@@ -1183,29 +1266,58 @@ namespace dircopy
 			{
 				if (file.size >= LARGE_THRESHOLD)
 				{
+					//Tree nodes are written by the block stages like the root, checkpointing waits on them too:
+					//
+
+					tree::Build<TH>(file.result, [&](auto& node)
+					{
+						auto [key, id] = identify<TH>(domain, node);
+
+						stats.atomic.memory += node.size();
+
+						file.pending->count++;
+
+						block_pipeline.Push(Block(std::move(node), key, id, node.size(), file.pending));
+
+						return key;
+					});
+
 					auto [key, id] = identify<TH>(domain, file.result);
 
 					stats.atomic.memory += file.result.size();
 
-					block_pipeline.Push(Block(std::move(file.result), key, id,file.result.size()));
+					file.pending->count++;
+
+					block_pipeline.Push(Block(std::move(file.result), key, id,file.result.size(),file.pending));
 
 					db.Apply(file.rel, file.size, file.change_time, key, file.queue);
 				}
 				else
 					db.Apply(file.rel, file.size, file.change_time, file.result, file.queue);
 
+				done(file.pending);
+
 				return true;
 			});
 		}
 
+		template < bool MMAP = true, typename DITR, typename TH, typename STORE, typename ON_FILE, typename D > void core_folder(delta::Path<TH>& db, Statistics& stats, std::string_view path, STORE& store, ON_FILE&& on_file, const D& domain = default_domain, size_t FILES = 1, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1, size_t LARGE_THRESHOLD = 128 * 1024 * 1024, std::string_view drive = "", size_t rel_count = 0, size_t MAX_MEMORY = 128 * 1024 * 1024, bool use_sequence = false, bool index = false)
+		{
+			core_entries<MMAP>(db, stats, path, DITR(path, std::filesystem::directory_options::skip_permission_denied), store, on_file, domain, FILES, BLOCK, THREADS, compression, GROUP, LARGE_THRESHOLD, MAX_MEMORY, use_sequence, index);
+		}
+
 		template < bool MMAP = true, typename DITR, typename TH, typename STORE, typename ON_FILE, typename D > TH submit_folder(std::string_view exclude, std::string_view delta_folder,Statistics& stats, std::string_view path, STORE& store, ON_FILE && on_file, const D& domain = default_domain, size_t FILES = 1, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1, size_t LARGE_THRESHOLD = 128 * 1024 * 1024, std::string_view drive = "", size_t rel = 0, size_t MAX_MEMORY = 128 * 1024 * 1024, bool sequence = false, bool index = false)
 		{
-			delta::Path<TH> db(delta_folder,exclude);
+			delta::Path<TH> db(delta_folder,exclude,true);
+
+			if (db.Resumed())
+				std::cout << "Resuming interrupted backup from its checkpoint..." << std::endl;
 
 			db.OpenForWriting();
 
 			core_folder<MMAP, DITR,TH>(db,stats, path, store, on_file, domain, FILES, BLOCK, THREADS, compression, GROUP, LARGE_THRESHOLD,drive,rel,MAX_MEMORY,sequence,index);
 
+			db.Directories();
 			db.Statistics(stats,domain);
 
 			stats.atomic.files++;
@@ -1213,6 +1325,17 @@ namespace dircopy
 			return submit_file2<MMAP,TH>(stats, db.Finalize(), store, domain, BLOCK, THREADS, compression, GROUP);
 		}
 
+		//Rebuilds the snapshot folder change tracking from an existing backup, path is the folder that was backed up.
+		//Returns the number of files tracked, the next backup only reads files changed since folder_key.
+		//
+
+		template < typename TH, typename STORE, typename D > uint64_t rebuild_state2(std::string_view snapshot, Statistics& stats, const TH& folder_key, STORE& store, const D& domain = default_domain, std::string_view path = "", size_t THREADS = 1)
+		{
+			restore::Database<TH> db(stats, folder_key, store, domain, true, true, THREADS);
+
+			return delta::Path<TH>::Rebuild(snapshot, db, path);
+		}
+
 		template < typename DITR, typename TH, typename ON_FILE > uint64_t delta_folder(std::string_view exclude, std::string_view snapshot, std::string_view path, ON_FILE && on_file, std::string_view drive = "", size_t rel = 0)
 		{
 			delta::Path<TH> db(snapshot,exclude);
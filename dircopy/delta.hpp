@@ -3,12 +3,34 @@
 #pragma once
 
 #include <string_view>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "d8u/transform.hpp"
 #include "d8u/util.hpp"
 #include "d8u/json.hpp"
 #include "tdb/legacy.hpp"
 
+#include "exclude.hpp"
+
 namespace dircopy
 {
 	namespace delta
@@ -16,31 +38,299 @@ namespace dircopy
 		using namespace d8u::transform;
 		using namespace d8u::json;
 
+		//lock.db is held for as long as a writing Path lives, with flock on posix and a handle nobody else may open on Windows.
+		//A lock.db nobody holds was left behind by a run that ended without Finalize.
+		//
+		class Lock
+		{
+#ifdef _WIN32
+			HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+		public:
+			Lock() { }
+			Lock(const Lock&) = delete;
+			~Lock() { Release(); }
+
+			//false when another process holds it:
+			//
+			bool Acquire(const std::string& name)
+			{
+#ifdef _WIN32
+				handle = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+				return handle != INVALID_HANDLE_VALUE;
+#else
+				for (;;)
+				{
+					fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+					if (fd < 0)
+						return false;
+
+					if (::flock(fd, LOCK_EX | LOCK_NB) != 0)
+					{
+						Release();
+						return false;
+					}
+
+					//Removed by its owner between open and flock, the lock is on a file nobody else sees:
+					//
+					struct stat opened, present;
+
+					if (::fstat(fd, &opened) == 0 && ::stat(name.c_str(), &present) == 0 && opened.st_ino == present.st_ino && opened.st_dev == present.st_dev)
+						return true;
+
+					Release();
+				}
+#endif
+			}
+
+			void Release()
+			{
+#ifdef _WIN32
+				if (handle != INVALID_HANDLE_VALUE)
+					CloseHandle(handle);
+
+				handle = INVALID_HANDLE_VALUE;
+#else
+				if (fd >= 0)
+					::close(fd);
+
+				fd = -1;
+#endif
+			}
+
+			static bool Held(const std::string& name)
+			{
+				if (!std::filesystem::exists(name))
+					return false;
+#ifdef _WIN32
+				auto h = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+				if (h == INVALID_HANDLE_VALUE)
+					return GetLastError() == ERROR_SHARING_VIOLATION;
+
+				CloseHandle(h);
+
+				return false;
+#else
+				int probe = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+
+				if (probe < 0)
+					return false;
+
+				bool held = ::flock(probe, LOCK_EX | LOCK_NB) != 0;
+
+				::close(probe);
+
+				return held;
+#endif
+			}
+		};
+
 		template < typename TH = _DefaultHash> class Path
 		{
+			bool writing;
+			Lock held;
+
+			bool resumed;
+			bool seeded;
+
+			uint64_t waste = 0;
+
+			std::mutex lock;
+			std::vector<uint64_t> kept;
+			std::map<std::string, uint64_t, std::less<>> folders;
+
 			tdb::TinyHashmapSafe change;
 			tdb::TinyHashmapSafe previous;
-			tdb::TinyHashmapSafe current;
+
+			std::unique_ptr<tdb::TinyHashmapSafe> current;
+			std::unique_ptr<tdb::TinyHashmapSafe> checkpoint;
 
 			JsonMap exclude;
+			dircopy::exclude::Rules rules;
 
 			std::string root;
+
+			static constexpr std::string_view RUNNING = "Change Tracking database is locked, a backup is running.";
+			static constexpr std::string_view LOCKED = "Change Tracking database is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the folder and try again.";
+
+			//A backup that left lock.db behind can be resumed when it kept a checkpoint, its tmp.db is discarded and rebuilt.
+			//checkpoint.db only exists once a checkpoint was committed, without a lock it is left over from a completed run.
+			//Paths that don't write never take the lock and never touch tmp.db or checkpoint.db, they only refuse to read while a backup runs.
+			//
+
+			static bool resumable(std::string_view _root, bool writing, Lock& held)
+			{
+				auto name = string(_root) + "/lock.db";
+
+				if (!writing)
+				{
+					if (Lock::Held(name))
+						throw std::runtime_error(string(RUNNING));
+
+					return false;
+				}
+
+				bool stale = std::filesystem::exists(name);
+
+				if (!held.Acquire(name))
+					throw std::runtime_error(string(RUNNING));
+
+				std::error_code ec;
+
+				if (!stale)
+				{
+					std::filesystem::remove(string(_root) + "/checkpoint.db", ec);
+					return false;
+				}
+
+				if (!std::filesystem::exists(string(_root) + "/checkpoint.db"))
+					throw std::runtime_error(string(LOCKED));
+
+				std::filesystem::remove(string(_root) + "/tmp.db", ec);
+
+				return true;
+			}
+
+			//Generations:
+			//A backup starts from a copy of latest.db, one sequential file copy, instead of an empty tmp.db.
+			//Records of unchanged files are then used where they are, only changed files are written. Records that die, deleted files or files whose record no longer fits, are renamed DIRECTORY in place.
+			//Every walker already skips internal records, restore::Database::Find checks the name. waste.db keeps the dead bytes of latest.db, past a quarter of the file the next backup starts empty and compacts.
+			//
+
+			static bool seed(std::string_view _root)
+			{
+				auto root = string(_root);
+
+				uint64_t bytes = 0, format = 0;
+				std::ifstream in(root + "/waste.db");
+
+				if (!(in >> bytes >> format) || format != FORMAT)
+					return false;
+
+				std::error_code ec;
+				auto total = std::filesystem::file_size(root + "/latest.db", ec);
+
+				if (ec || bytes * 4 > total)
+					return false;
+
+				std::filesystem::copy_file(root + "/latest.db", root + "/tmp.db", std::filesystem::copy_options::overwrite_existing, ec);
+
+				return !ec;
+			}
+
+			static uint64_t dead(std::string_view _root)
+			{
+				uint64_t dead = 0;
+				std::ifstream in(string(_root) + "/waste.db");
+
+				in >> dead;
+
+				return dead;
+			}
+
+			uint64_t neuter(uint8_t* record)
+			{
+				if (*(uint32_t*)record & COMPACT)
+				{
+					stream(record, Extent(record), DIRECTORY, 0, 0, gsl::span<uint8_t>());
+					return Extent(record);
+				}
+
+				*(uint64_t*)(record + 4) = 0;
+				*(uint64_t*)(record + 12) = 0;
+				*(uint16_t*)(record + 20) = (uint16_t)DIRECTORY.size();
+				std::copy(DIRECTORY.begin(), DIRECTORY.end(), record + 22);
+				*(uint16_t*)(record + 22 + DIRECTORY.size()) = 0;
+
+				return Extent(record);
+			}
+
+			//Records are only reused when they describe the file as it is now, change.db may hold times of an interrupted run.
+			//Compact records keep the whole size, both formats keep 32 bits of the time:
+			//
+			static bool matches(uint8_t* record, uint64_t size, uint64_t when)
+			{
+				auto [record_size, record_time, name, keys] = Decode(record);
+
+				if (record_time != (uint32_t)when)
+					return false;
+
+				return (*(uint32_t*)record & COMPACT) ? record_size == size : record_size == (uint32_t)size;
+			}
+
+			static bool child(uint8_t* record, uint64_t parent, std::string_view leaf, uint32_t flags = 0)
+			{
+				return (*(uint32_t*)record & (COMPACT | PARENT | FOLDER)) == (COMPACT | PARENT | flags) && Up(record) == parent && std::get<2>(DecodeRaw(record)) == leaf;
+			}
+
+			//Offset + 1 of the path record of dir, 0 for the root. Made below the path record of its parent on first use, a seeded generation finds those of latest.db.
+			//Called with lock held:
+			//
+			uint64_t folder(std::string_view dir)
+			{
+				if (!dir.size())
+					return 0;
+
+				if (auto it = folders.find(dir); it != folders.end())
+					return it->second;
+
+				auto parent = folder(Parent(dir));
+				auto leaf = dir.substr(Parent(dir).size());
+				auto name = std::string(PREFIX) + std::string(dir);
+
+				auto p = current->Find(name);
+
+				if (p)
+				{
+					auto record = current->GetObject(*p);
+
+					if (child(record, parent, leaf, FOLDER))
+						return folders.emplace(std::string(dir), *p + 1).first->second;
+
+					if (*(uint32_t*)record & FOLDER)
+						waste += neuter(record);
+				}
+
+				auto b_size = child_size(parent, leaf, 0);
+				auto [queue, off] = current->Incidental(b_size);
+
+				stream_child(queue, b_size, FOLDER, parent, leaf, 0, 0, gsl::span<uint8_t>());
+
+				if (p)
+					*p = off;
+				else
+					current->Insert(name, off);
+
+				return folders.emplace(std::string(dir), off + 1).first->second;
+			}
 		public:
-			Path(std::string_view _root,std::string_view _exclude)
-				: change(string(_root) + "/change.db")
+			//writing starts the new generation from latest.db, without it tmp.db starts empty.
+			//
+			Path(std::string_view _root,std::string_view _exclude, bool _writing = false)
+				: writing(_writing)
+				, resumed(resumable(_root, writing, held))
+				, seeded(writing && !resumed && seed(_root))
+				, waste(seeded ? dead(_root) : 0)
+				, change(string(_root) + "/change.db")
 				, previous(string(_root) + "/latest.db")
-				, current(string(_root) + "/tmp.db")
-				, root ( _root )
+				, current(writing ? std::make_unique<tdb::TinyHashmapSafe>(string(_root) + "/tmp.db") : nullptr)
+				, checkpoint(resumed ? std::make_unique<tdb::TinyHashmapSafe>(string(_root) + "/checkpoint.db") : nullptr)
 				, exclude(_exclude)
-			{ 
-				if (std::filesystem::exists(string(_root) + "/lock.db"))
-					throw std::runtime_error("Change Tracking database is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the folder and try again.");
-			}
+				, rules(exclude)
+				, root ( _root )
+			{ }
 
 			~Path() { }
 
 			std::string Root() { return root; }
 
+			bool Resumed() { return resumed; }
+
 			struct FolderStatistics
 			{
 				uint64_t target;
@@ -60,11 +350,15 @@ namespace dircopy
 
 				auto b_size = bundle_size("|||Backup Statistics|||", sizeof(FolderStatistics));
 
-				auto [queue, off] = current.Incidental(b_size);
+				if (auto p = (seeded) ? current->Find(domain) : nullptr; p && *(uint32_t*)current->GetObject(*p) == (COMPACT | b_size))
+				{
+					stream(current->GetObject(*p), b_size, "|||Backup Statistics|||", 0, 0, gsl::span<uint8_t>((uint8_t*)&stats, sizeof(FolderStatistics)));
+					return;
+				}
 
-				*(uint32_t*)(queue) = (uint32_t)b_size;
+				auto [queue, off] = current->Incidental(b_size);
 
-				current.Insert(domain, off);
+				current->Insert(domain, off);
 
 				//There used to be a time stamp in this object. This however caused deduplication of metadata to always fail.
 				//NO TIME STAMPS.
@@ -73,16 +367,231 @@ namespace dircopy
 				stream(queue, b_size, "|||Backup Statistics|||", 0, 0, gsl::span<uint8_t>((uint8_t*)&stats,sizeof(FolderStatistics)));
 			}
 
+			//Directory index:
+			//Each directory gets records named DIRECTORY + path + "|||" + chunk, chunk 0 starts with the aggregate ( u64 size, u64 files, u64 entries ).
+			//Entries are u8 kind ( 0 file, 1 directory ), u16 name length, name relative to the directory including the separator. Chunks stay within the u16 record payload.
+			//
+
+			static constexpr std::string_view DIRECTORY = "|||Directory|||";
+
+			static bool Listing(std::string_view name)
+			{
+				return name.size() >= DIRECTORY.size() && name.substr(0, DIRECTORY.size()) == DIRECTORY;
+			}
+
+			//Directory index, statistics and dead records, anything that isn't a file of the backup:
+			//
+			static bool Internal(std::string_view name)
+			{
+				return name.size() >= 3 && name.substr(0, 3) == "|||";
+			}
+
+			static std::string_view Parent(std::string_view name)
+			{
+				auto end = name.find_last_of("\\/");
+
+				return (end == std::string_view::npos) ? std::string_view() : name.substr(0, end);
+			}
+
+			static std::string_view Leaf(std::string_view name)
+			{
+				auto end = name.find_last_of("\\/");
+
+				return (end == std::string_view::npos) ? name : name.substr(end + 1);
+			}
+
+			static std::string DirectoryRecord(std::string_view dir, size_t chunk)
+			{
+				return std::string(DIRECTORY) + std::string(dir) + "|||" + std::to_string(chunk);
+			}
+
+			void Directories()
+			{
+				struct Directory
+				{
+					uint64_t size = 0;
+					uint64_t files = 0;
+
+					std::vector<std::pair<std::string, uint8_t>> entries;
+				};
+
+				std::map<std::string, Directory, std::less<>> tree;
+				tree[""];
+
+				std::map<std::string, uint64_t, std::less<>> stale;
+
+				std::vector<uint64_t> paths;
+				std::unordered_set<uint64_t> used;
+
+				std::sort(kept.begin(), kept.end());
+
+				current->Iterate([&](uint64_t p)
+				{
+					auto record = current->GetObject(p);
+					auto [size, time, stored, keys] = Decode(record);
+
+					if (*(uint32_t*)record & FOLDER)
+					{
+						paths.push_back(p);
+						return true;
+					}
+
+					if (Internal(stored))
+					{
+						if (seeded && Listing(stored) && stored.size() > DIRECTORY.size())
+							stale.emplace(stored, p);
+
+						return true;
+					}
+
+					if (seeded && !std::binary_search(kept.begin(), kept.end(), p))
+					{
+						waste += neuter(record);
+						return true;
+					}
+
+					//Fresh records are named by Apply, one still empty belongs to a file that was never backed up:
+					//
+
+					if (!stored.size())
+					{
+						waste += neuter(record);
+						return true;
+					}
+
+					for (auto up = Up(record); up && used.insert(up).second; up = Up(current->GetObject(up - 1)));
+
+					auto name = Name(*current, record);
+					auto dir = Parent(name);
+
+					std::vector<std::string_view> missing;
+
+					for (auto d = dir; tree.find(d) == tree.end(); d = Parent(d))
+						missing.push_back(d);
+
+					for (auto it = missing.rbegin(); it != missing.rend(); it++)
+					{
+						tree.find(Parent(*it))->second.entries.push_back(std::make_pair(std::string(it->substr(Parent(*it).size())), (uint8_t)1));
+						tree[std::string(*it)];
+					}
+
+					tree.find(dir)->second.entries.push_back(std::make_pair(std::string(name.substr(dir.size())), (uint8_t)0));
+
+					for (auto d = dir;; d = Parent(d))
+					{
+						auto& aggregate = tree.find(d)->second;
+
+						aggregate.size += size;
+						aggregate.files++;
+
+						if (!d.size())
+							break;
+					}
+
+					return true;
+				});
+
+				auto write = [&](std::string_view dir, size_t chunk, const std::vector<uint8_t>& data)
+				{
+					auto name = DirectoryRecord(dir, chunk);
+					auto b_size = bundle_size(name, data.size());
+
+					auto old = stale.find(name);
+
+					if (old != stale.end())
+					{
+						auto record = current->GetObject(old->second);
+
+						stale.erase(old);
+
+						if (*(uint32_t*)record == (COMPACT | b_size))
+						{
+							stream(record, b_size, name, 0, 0, data);
+							return;
+						}
+
+						waste += neuter(record);
+
+						auto [queue, off] = current->Incidental(b_size);
+
+						*current->Find(name) = off;
+
+						stream(queue, b_size, name, 0, 0, data);
+						return;
+					}
+
+					auto [queue, off] = current->Incidental(b_size);
+
+					current->Insert(name, off);
+
+					stream(queue, b_size, name, 0, 0, data);
+				};
+
+				for (auto& [dir, d] : tree)
+				{
+					std::vector<uint8_t> data(sizeof(uint64_t) * 3);
+
+					*(uint64_t*)(data.data()) = d.size;
+					*(uint64_t*)(data.data() + 8) = d.files;
+					*(uint64_t*)(data.data() + 16) = d.entries.size();
+
+					size_t chunk = 0;
+
+					for (auto& [name, kind] : d.entries)
+					{
+						if (data.size() + 3 + name.size() > 0xffff)
+						{
+							write(dir, chunk++, data);
+							data.clear();
+						}
+
+						data.push_back(kind);
+						data.push_back((uint8_t)(name.size() & 0xff));
+						data.push_back((uint8_t)(name.size() >> 8));
+						data.insert(data.end(), name.begin(), name.end());
+					}
+
+					write(dir, chunk, data);
+				}
+
+				for (auto& [name, p] : stale)
+					waste += neuter(current->GetObject(p));
+
+				//Path records no live file hangs below any more:
+				//
+
+				for (auto p : paths)
+				{
+					if (!used.count(p + 1))
+						waste += neuter(current->GetObject(p));
+				}
+			}
+
+			//lock.db is taken when a writing Path is constructed:
+			//
 			void OpenForWriting()
 			{
-				d8u::util::empty_file(string(root) + "/lock.db");
+				if (!writing)
+					throw std::runtime_error("Change Tracking database was not opened for writing");
+			}
+
+			//A lock.db no process holds and no checkpoint to resume from, what a backup that failed leaves behind:
+			//
+			static bool Stale(std::string_view _root)
+			{
+				auto name = string(_root) + "/lock.db";
+
+				return std::filesystem::exists(name) && !std::filesystem::exists(string(_root) + "/checkpoint.db") && !Lock::Held(name);
 			}
 
 			std::string Finalize()
 			{
 				change.Close();
 				previous.Close();
-				current.Close();
+				current->Close();
+
+				if (checkpoint)
+					checkpoint->Close();
 
 				std::error_code err;
 				if (!std::filesystem::remove(string(root) + "/latest.db"),err)
@@ -92,31 +601,84 @@ namespace dircopy
 				if(err)
 					throw std::runtime_error(err.message());
 
+				std::ofstream(string(root) + "/waste.db", std::ios::trunc) << waste << " " << FORMAT;
+
+				std::filesystem::remove(string(root) + "/checkpoint.db", err);
 				std::filesystem::remove(string(root) + "/lock.db");
 
+				held.Release();
+
 				return string(root) + "/latest.db";
 			}
 
-			bool Excluded(std::string_view s)
+			//Recreates the change tracking state Finalize leaves behind from a decoded folder database, the database is latest.db as it was uploaded.
+			//Records keep the low 32 bits of the time, legacy records also only those of the size. With path, files still matching them on disk are tracked by their full change time so the next backup skips them.
+			//lock.db stays in place until both databases are written, an interrupted rebuild is refused like an interrupted backup.
+			//
+
+			template <typename DB> static uint64_t Rebuild(std::string_view _root, DB& db, std::string_view path = "")
 			{
-				auto path = exclude("path");
-				auto file = exclude("file")[s];
+				auto root = string(_root);
 
-				if (file)
-					return true;
+				Lock held;
+
+				if (!held.Acquire(root + "/lock.db"))
+					throw std::runtime_error(string(RUNNING));
+
+				for (auto name : { "/change.db", "/latest.db", "/tmp.db", "/checkpoint.db", "/waste.db" })
+					std::filesystem::remove(root + name);
 
-				bool exclude = false;
+				std::filesystem::copy_file(db.Path(), root + "/latest.db");
 
-				path.ForEachValue([&](auto key, auto value) 
+				tdb::TinyHashmapSafe change(root + "/change.db");
+				uint64_t count = 0;
+
+				db.Iterate([&](uint64_t p)
 				{
-					if (s.size() >= key.size())
+					auto [size, time, name, keys] = Decode(db, db.GetObject(p));
+
+					if (Internal(name))
+						return true;
+
+					uint64_t when = time;
+
+					if (path.size())
 					{
-						if(std::equal((char*)key.data(),(char*)key.data()+key.size(),s.begin(),s.begin() + key.size()))
-							exclude = true;
+						auto full = string(path) + string(name);
+
+						std::error_code ec;
+						auto current_size = std::filesystem::file_size(full, ec);
+
+						if (!ec && (uint32_t)current_size == (uint32_t)size)
+						{
+							auto current_time = d8u::util::GetFileWriteTime2(full);
+
+							if ((uint32_t)current_time == (uint32_t)time)
+								when = current_time;
+						}
 					}
+
+					change.Insert(name, when);
+					count++;
+
+					return true;
 				});
 
-				return exclude;
+				change.Close();
+
+				std::filesystem::remove(root + "/lock.db");
+
+				return count;
+			}
+
+			bool Excluded(std::string_view s)
+			{
+				return rules.Excluded(s);
+			}
+
+			bool Pruned(std::string_view directory)
+			{
+				return rules.Pruned(directory);
 			}
 
 			uint8_t* Queue(std::string_view s, uint64_t size, uint64_t when, uint64_t BLOCK, uint64_t MAX)
@@ -126,12 +688,44 @@ namespace dircopy
 
 				auto key_payload = (size > MAX) ? 32 : 32 * (size / BLOCK + 1 /*FILE HASH*/ + ((size % BLOCK) ? 1 : 0));
 
-				auto b_size = bundle_size(s, key_payload);
-				auto [queue, off] = current.Incidental(b_size);
+				std::lock_guard<std::mutex> guard(lock);
+
+				auto parent = folder(Parent(s));
+				auto leaf = s.substr(Parent(s).size());
 
-				*(uint32_t*)(queue) = (uint32_t)b_size;
+				auto b_size = child_size(parent, leaf, key_payload, size, when);
 
-				current.Insert(s, off);
+				auto p = (seeded) ? current->Find(s) : nullptr;
+
+				if (p)
+				{
+					auto record = current->GetObject(*p);
+
+					if (child(record, parent, leaf))
+					{
+						if (Extent(record) == b_size)
+						{
+							kept.push_back(*p);
+							return record;
+						}
+
+						waste += neuter(record);
+					}
+				}
+
+				//Fresh records carry their parent but no leaf until they are written, Changed tells them from reused ones:
+				//
+				auto [queue, off] = current->Incidental(b_size);
+
+				stream_child(queue, b_size, 0, parent, "", 0, 0, gsl::span<uint8_t>());
+
+				if (p)
+					*p = off;
+				else
+					current->Insert(s, off);
+
+				if (seeded)
+					kept.push_back(off);
 
 				return queue;
 			}
@@ -146,49 +740,281 @@ namespace dircopy
 
 				auto [pointer,would_write] = change.Insert(s, when);
 
+				if (resumed)
+				{
+					auto data = checkpoint->Find(s);
+
+					if (data)
+					{
+						auto ptr = checkpoint->GetObject(*data);
+
+						if (std::get<2>(Decode(ptr)) == s && Reuse(ptr, queue, s, size, when))
+							return false;
+					}
+				}
+
 				if (would_write && *pointer == when)
 				{
+					if (seeded && std::get<2>(Decode(queue)).size())
+						return false;
+
 					auto data = previous.Find(s);
+
+					if (data && std::get<2>(Decode(previous, previous.GetObject(*data))) != s)
+						data = nullptr;
 						
 					if (!data)
+					{
+						if (resumed)
+							return true;
+
 						throw std::runtime_error("Bad delta state");
+					}
 
-					auto ptr = previous.GetObject(*data);
+					return !Reuse(previous.GetObject(*data), queue, s, size, when);
+				}
+
+				return true;
+			}
 
-					std::copy(ptr, ptr + *((uint32_t*)ptr), queue);
+			//Called once the record of a changed file is applied and the store acknowledged all of its blocks.
+			//A resumed run takes these records instead of reading and hashing the files again. They keep the whole name, tmp.db and its path records are made again on resume.
+			//
+			void Checkpoint(std::string_view s, uint8_t* queue)
+			{
+				{
+					std::lock_guard<std::mutex> guard(lock);
 
-					return false;
+					if (!checkpoint)
+						checkpoint = std::make_unique<tdb::TinyHashmapSafe>(root + "/checkpoint.db");
 				}
 
-				return true;
+				auto [size, time, leaf, keys] = DecodeRaw(queue);
+				auto b_size = bundle_size(s, keys.size(), size, time);
+
+				auto [record, off] = checkpoint->Incidental(b_size);
+
+				stream(record, b_size, s, size, time, keys);
+
+				checkpoint->Insert(s, off);
+			}
+
+			//Copies the records of latest.db for files known not to have changed without looking at them, keep(name, size) decides.
+			//A seeded tmp.db already holds them, they are only marked as kept.
+			//Used when a change journal lists everything else, returns the number of records carried.
+			//
+			template <typename F> uint64_t Carry(F&& keep)
+			{
+				uint64_t count = 0;
+
+				if (seeded)
+				{
+					current->Iterate([&](uint64_t p)
+					{
+						auto [size, time, name, keys] = Decode(*current, current->GetObject(p));
+
+						if (Internal(name))
+							return true;
+
+						if (Excluded(name) || !keep(name, size))
+							return true;
+
+						kept.push_back(p);
+						count++;
+
+						return true;
+					});
+
+					return count;
+				}
+
+				previous.Iterate([&](uint64_t p)
+				{
+					auto ptr = previous.GetObject(p);
+					auto [size, time, name, keys] = Decode(previous, ptr);
+
+					if (Internal(name))
+						return true;
+
+					if (Excluded(name) || !keep(name, size))
+						return true;
+
+					//Written again below the path records of tmp.db:
+					//
+
+					auto raw = std::get<3>(DecodeRaw(ptr));
+
+					std::lock_guard<std::mutex> guard(lock);
+
+					auto parent = folder(Parent(name));
+					auto leaf = std::string_view(name).substr(Parent(name).size());
+
+					auto b_size = child_size(parent, leaf, raw.size(), size, time);
+					auto [queue, off] = current->Incidental(b_size);
+
+					stream_child(queue, b_size, 0, parent, leaf, size, time, raw);
+
+					current->Insert(name, off);
+					count++;
+
+					return true;
+				});
+
+				return count;
 			}
 
 			template <typename T> void Apply(std::string_view s, uint64_t size, uint64_t when, const T& k, uint8_t * queue)
 			{
-				auto b_size = *(uint32_t*)queue;
+				stream_child(queue, Extent(queue), 0, Up(queue), s.substr(Parent(s).size()), size, when, k);
+			}
 
-				stream(queue, b_size, s, size, when, k);
+			//Record formats:
+			//The original layout is u32 extent, u64 size, u64 time, u16 name length, name, u16 key bytes, keys. Size and time only ever held 32 bits.
+			//Compact records set the top bit of the extent, then size, time, name length and key bytes are varints ( 7 bits per byte, low first ). Size keeps all 64 bits.
+			//Both are read everywhere, new records are always compact.
+			//
+			//Paths are front coded. File records also set PARENT, a varint after the time holds offset + 1 of the path record of their directory and the name is only what follows it.
+			//Path records set FOLDER and hold one directory below their own parent the same way, the hash map knows them as PREFIX + directory.
+			//Decode(db, p) puts names back together, Decode(p) only sees what the record stores. Internal records and checkpoint.db keep whole names.
+			//
+
+			static constexpr uint32_t COMPACT = 0x80000000;
+			static constexpr uint32_t PARENT = 0x40000000;
+			static constexpr uint32_t FOLDER = 0x20000000;
+
+			static constexpr uint64_t FORMAT = 3;
+
+			static constexpr std::string_view PREFIX = "|||Path|||";
+
+			static uint32_t Extent(uint8_t* p)
+			{
+				return *(uint32_t*)p & ~(COMPACT | PARENT | FOLDER);
 			}
 
-			static auto Decode(uint8_t* p)
+			//Offset + 1 of the path record above a record, 0 when its name is whole or at the root:
+			//
+			static uint64_t Up(uint8_t* p)
 			{
-				uint32_t extent = *(uint32_t*)p;
-				uint64_t size = *(uint64_t*)(p + 4);
-				uint64_t time = *(uint64_t*)(p + 12);
-				uint16_t ns = *(uint16_t*)(p + 20);
+				if ((*(uint32_t*)p & (COMPACT | PARENT)) != (COMPACT | PARENT))
+					return 0;
 
-				std::string_view name((char*)(p + 22), ns);
+				auto q = p + sizeof(uint32_t);
 
-				uint16_t ds = *(uint16_t*)(p + 22 + ns);
+				varint(q);
+				varint(q);
+
+				return varint(q);
+			}
+
+			template <typename DB> static std::string Name(DB& db, uint8_t* p)
+			{
+				std::vector<std::string_view> parts = { std::get<2>(DecodeRaw(p)) };
+
+				for (auto up = Up(p); up;)
+				{
+					auto q = db.GetObject(up - 1);
+
+					if (parts.size() > 0xffff || !(*(uint32_t*)q & FOLDER))
+						throw std::runtime_error("Malformed Folder Record");
+
+					parts.push_back(std::get<2>(DecodeRaw(q)));
+					up = Up(q);
+				}
+
+				std::string name = (*(uint32_t*)p & FOLDER) ? std::string(PREFIX) : std::string();
+
+				for (auto it = parts.rbegin(); it != parts.rend(); it++)
+					name += *it;
+
+				return name;
+			}
+
+			static uint64_t varint(uint8_t*& p)
+			{
+				uint64_t v = 0;
+
+				for (int shift = 0;; shift += 7)
+				{
+					auto b = *p++;
+
+					v |= (uint64_t)(b & 0x7f) << shift;
+
+					if (!(b & 0x80))
+						return v;
+				}
+			}
+
+			//Writes the keys of a previous record of s into a queued one, keeping the queued layout and parent.
+			//Size and time are the file's as it is now, legacy records only hold their low 32 bits. false when the record doesn't describe the file or its keys don't fit, the file is then read again.
+			//
+			static bool Reuse(uint8_t* from, uint8_t* to, std::string_view s, uint64_t size, uint64_t when)
+			{
+				if (!matches(from, size, when))
+					return false;
+
+				auto keys = std::get<3>(DecodeRaw(from));
 
-				span<TH> data((TH*)(p + 24+ns), ds / sizeof(TH));
+				if (*(uint32_t*)to & PARENT)
+				{
+					auto parent = Up(to);
+					auto leaf = s.substr(Parent(s).size());
+
+					if (child_size(parent, leaf, keys.size(), size, when) > Extent(to))
+						return false;
+
+					stream_child(to, Extent(to), 0, parent, leaf, size, when, keys);
+
+					return true;
+				}
+
+				if (bundle_size(s, keys.size(), size, when) > Extent(to))
+					return false;
+
+				stream(to, Extent(to), s, size, when, keys);
+
+				return true;
+			}
+
+			static auto Decode(uint8_t* p)
+			{
+				auto [size, time, name, raw] = DecodeRaw(p);
+
+				span<TH> data((TH*)raw.data(), raw.size() / sizeof(TH));
 
 				return std::make_tuple(size, time, name, data);
 			}
 
+			//Whole names, path records are read from db:
+			//
+			template <typename DB> static auto Decode(DB& db, uint8_t* p)
+			{
+				auto [size, time, stored, data] = Decode(p);
+
+				return std::make_tuple(size, time, Name(db, p), data);
+			}
+
 			static auto DecodeRaw(uint8_t* p)
 			{
-				uint32_t extent = *(uint32_t*)p;
+				if (*(uint32_t*)p & COMPACT)
+				{
+					auto q = p + sizeof(uint32_t);
+
+					uint64_t size = varint(q);
+					uint64_t time = varint(q);
+
+					if (*(uint32_t*)p & PARENT)
+						varint(q);
+
+					auto ns = varint(q);
+
+					std::string_view name((char*)q, ns);
+					q += ns;
+
+					auto ds = varint(q);
+
+					return std::make_tuple(size, time, name, span<uint8_t>(q, ds));
+				}
+
 				uint64_t size = *(uint64_t*)(p + 4);
 				uint64_t time = *(uint64_t*)(p + 12);
 				uint16_t ns = *(uint16_t*)(p + 20);
@@ -204,20 +1030,65 @@ namespace dircopy
 
 		private:
 
-			size_t bundle_size(std::string_view s, size_t k_size)
+			static size_t varint_size(uint64_t v)
+			{
+				size_t n = 1;
+
+				for (; v >= 0x80; v >>= 7)
+					n++;
+
+				return n;
+			}
+
+			static void put_varint(uint8_t*& p, uint64_t v)
+			{
+				for (; v >= 0x80; v >>= 7)
+					*p++ = (uint8_t)(v | 0x80);
+
+				*p++ = (uint8_t)v;
+			}
+
+			static size_t bundle_size(std::string_view s, size_t k_size, uint64_t size = 0, uint64_t when = 0)
+			{
+				return sizeof(uint32_t) + varint_size(size) + varint_size((uint32_t)when) + varint_size(s.size()) + s.size() + varint_size(k_size) + k_size;
+			}
+
+			//The key bytes written can be fewer than were reserved, their varint is never longer:
+			//
+			template <typename T> static void stream(uint8_t* dest, size_t b_size, std::string_view s, uint64_t size, uint64_t when, const T& k)
+			{
+				*(uint32_t*)(dest) = COMPACT | (uint32_t)b_size;
+
+				auto q = dest + sizeof(uint32_t);
+
+				put_varint(q, size);
+				put_varint(q, (uint32_t)when);
+				put_varint(q, s.size());
+				std::copy(s.begin(), s.end(), q);
+				q += s.size();
+				put_varint(q, k.size());
+				std::copy(k.begin(), k.end(), q);
+			}
+
+			static size_t child_size(uint64_t parent, std::string_view leaf, size_t k_size, uint64_t size = 0, uint64_t when = 0)
 			{
-				return sizeof(uint32_t) + sizeof(uint64_t) * 2 + sizeof(uint16_t) * 2 + s.size()  + k_size;
+				return bundle_size(leaf, k_size, size, when) + varint_size(parent);
 			}
 
-			template <typename T> void stream(uint8_t* dest, size_t b_size, std::string_view s, uint64_t size, uint64_t when, const T& k)
+			template <typename T> static void stream_child(uint8_t* dest, size_t b_size, uint32_t flags, uint64_t parent, std::string_view leaf, uint64_t size, uint64_t when, const T& k)
 			{
-				*(uint32_t*)(dest) = (uint32_t)b_size;
-				*(uint64_t*)(dest + 4) = (uint32_t)size;
-				*(uint64_t*)(dest + 12) = (uint32_t)when;
-				*(uint16_t*)(dest + 20) = (uint16_t)s.size();
-				std::copy(s.begin(), s.end(), dest + 22);
-				*(uint16_t*)(dest + 22 + s.size()) = (uint32_t)k.size();
-				std::copy(k.begin(), k.end(), dest + 24 + s.size());
+				*(uint32_t*)(dest) = COMPACT | PARENT | flags | (uint32_t)b_size;
+
+				auto q = dest + sizeof(uint32_t);
+
+				put_varint(q, size);
+				put_varint(q, (uint32_t)when);
+				put_varint(q, parent);
+				put_varint(q, leaf.size());
+				std::copy(leaf.begin(), leaf.end(), q);
+				q += leaf.size();
+				put_varint(q, k.size());
+				std::copy(k.begin(), k.end(), q);
 			}
 		};
 	}
@@ -0,0 +1,212 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <algorithm>
+#include <ostream>
+
+#include "d8u/transform.hpp"
+#include "d8u/util.hpp"
+
+#include "defs.hpp"
+#include "delta.hpp"
+#include "restore.hpp"
+
+namespace dircopy
+{
+	namespace diff
+	{
+		using namespace defs;
+		using namespace d8u::util;
+		using namespace d8u::transform;
+
+		enum class Change
+		{
+			added,
+			removed,
+			modified,
+			unchanged
+		};
+
+		inline const char* to_string(Change c)
+		{
+			switch (c)
+			{
+			case Change::added: return "added";
+			case Change::removed: return "removed";
+			case Change::modified: return "modified";
+			default: return "unchanged";
+			}
+		}
+
+		struct Summary
+		{
+			uint64_t added = 0;
+			uint64_t removed = 0;
+			uint64_t modified = 0;
+			uint64_t unchanged = 0;
+
+			uint64_t added_bytes = 0;
+			uint64_t removed_bytes = 0;
+			uint64_t changed_bytes = 0;
+			uint64_t changed_blocks = 0;
+		};
+
+		//Compares the metadata of two snapshots, file data blocks are never read.
+		//Every file of before is looked up in after by name ( a hash join on the folder database ), then files only in after are added.
+		//Content is compared by key, blocks are only compared position by position for modified files.
+		//f(change, name, size before, size after, changed blocks)
+		//
+
+		template <typename TH, typename S, typename D, typename F> Summary core_diff(Statistics& s, const TH& before_key, const TH& after_key, S& store, const D& domain, F&& f, size_t BLOCK = 1024 * 1024, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			restore::Database<TH> before(s, before_key, store, domain, true, true, 1, cache, CACHE);
+			restore::Database<TH> after(s, after_key, store, domain, true, true, 1, cache, CACHE);
+
+			Summary summary;
+
+			//Large files keep one key pointing to their key list, only read when the file changed:
+			//
+
+			auto key_list = [&](span<TH> keys, d8u::sse_vector& storage)
+			{
+				if (keys.size() != 1)
+					return keys;
+
+				storage = restore::list(s, *keys.data(), store, domain, true);
+
+				return span<TH>((TH*)storage.data(), storage.size() / sizeof(TH));
+			};
+
+			auto same = [](span<TH> l, span<TH> r)
+			{
+				return l.size() == r.size() && std::equal((uint8_t*)l.data(), (uint8_t*)(l.data() + l.size()), (uint8_t*)r.data());
+			};
+
+			before.Iterate([&](uint64_t p)
+			{
+				auto [size, time, name, keys] = before.Record(p);
+
+				if (delta::Path<TH>::Internal(name))
+					return true;
+
+				auto q = after.Find(name);
+
+				if (!q)
+				{
+					summary.removed++;
+					summary.removed_bytes += size;
+
+					return f(Change::removed, name, size, 0, 0);
+				}
+
+				auto [size2, time2, name2, keys2] = after.Record(*q);
+
+				if (size == size2 && same(keys, keys2))
+				{
+					summary.unchanged++;
+
+					return f(Change::unchanged, name, size, size2, 0);
+				}
+
+				d8u::sse_vector l_storage, r_storage;
+
+				uint64_t changed = 0;
+
+				try
+				{
+					auto l = key_list(keys, l_storage);
+					auto r = key_list(keys2, r_storage);
+
+					auto lb = l.size() ? l.size() - 1 /*Last hash is the file hash*/ : 0;
+					auto rb = r.size() ? r.size() - 1 : 0;
+
+					for (size_t i = 0; i < rb; i++)
+					{
+						if (i >= lb || !std::equal(l[i].begin(), l[i].end(), r[i].begin()))
+							changed++;
+					}
+				}
+				catch (...)
+				{
+					changed = size2 / BLOCK + ((size2 % BLOCK) ? 1 : 0);
+				}
+
+				summary.modified++;
+				summary.changed_blocks += changed;
+				summary.changed_bytes += std::min<uint64_t>(changed * BLOCK, size2);
+
+				return f(Change::modified, name, size, size2, changed);
+			});
+
+			after.Iterate([&](uint64_t p)
+			{
+				auto [size, time, name, keys] = after.Record(p);
+
+				if (delta::Path<TH>::Internal(name) || before.Find(name))
+					return true;
+
+				summary.added++;
+				summary.added_bytes += size;
+
+				return f(Change::added, name, 0, size, 0);
+			});
+
+			return summary;
+		}
+
+		inline void json_string(std::ostream& out, std::string_view v)
+		{
+			out << '"';
+
+			for (auto c : v)
+			{
+				switch (c)
+				{
+				case '"': out << "\\\""; break;
+				case '\\': out << "\\\\"; break;
+				case '\n': out << "\\n"; break;
+				case '\r': out << "\\r"; break;
+				case '\t': out << "\\t"; break;
+				default:
+					if ((uint8_t)c < 0x20)
+						out << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xf] << "0123456789abcdef"[c & 0xf];
+					else
+						out << c;
+				}
+			}
+
+			out << '"';
+		}
+
+		//One JSON object per line, the summary is the last line. unchanged files are only written when asked for:
+		//
+		template <typename TH, typename S, typename D> Summary json(Statistics& s, std::ostream& out, const TH& before_key, const TH& after_key, S& store, const D& domain, bool unchanged = false, size_t BLOCK = 1024 * 1024, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			auto summary = core_diff(s, before_key, after_key, store, domain, [&](auto change, auto name, auto before, auto after, auto blocks)
+			{
+				if (change == Change::unchanged && !unchanged)
+					return true;
+
+				out << "{\"change\":\"" << to_string(change) << "\",\"name\":";
+				json_string(out, name);
+				out << ",\"before\":" << before << ",\"after\":" << after << ",\"blocks\":" << blocks << "}\n";
+
+				return true;
+			}, BLOCK, cache, CACHE);
+
+			out << "{\"summary\":{\"added\":" << summary.added
+				<< ",\"removed\":" << summary.removed
+				<< ",\"modified\":" << summary.modified
+				<< ",\"unchanged\":" << summary.unchanged
+				<< ",\"added_bytes\":" << summary.added_bytes
+				<< ",\"removed_bytes\":" << summary.removed_bytes
+				<< ",\"changed_bytes\":" << summary.changed_bytes
+				<< ",\"changed_blocks\":" << summary.changed_blocks << "}}" << std::endl;
+
+			return summary;
+		}
+	}
+}
@@ -0,0 +1,188 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+#include "match.hpp"
+
+namespace dircopy
+{
+	namespace exclude
+	{
+		//Byte trie, Match is true when any inserted string is a prefix of the input:
+		//
+		class Trie
+		{
+			struct Node
+			{
+				std::vector<std::pair<uint8_t, uint32_t>> next;
+				bool end = false;
+			};
+
+			std::vector<Node> nodes = std::vector<Node>(1);
+
+			uint32_t child(uint32_t n, uint8_t c) const
+			{
+				auto& next = nodes[n].next;
+				auto it = std::lower_bound(next.begin(), next.end(), std::make_pair(c, (uint32_t)0));
+
+				return (it != next.end() && it->first == c) ? it->second : 0;
+			}
+
+		public:
+			bool Empty() const { return nodes.size() == 1 && !nodes[0].end; }
+
+			template < typename IT > void Insert(IT begin, IT end)
+			{
+				uint32_t n = 0;
+
+				for (auto i = begin; i != end; i++)
+				{
+					auto c = (uint8_t)*i;
+					auto next = child(n, c);
+
+					if (!next)
+					{
+						next = (uint32_t)nodes.size();
+
+						auto& list = nodes[n].next;
+						list.insert(std::lower_bound(list.begin(), list.end(), std::make_pair(c, (uint32_t)0)), std::make_pair(c, next));
+
+						nodes.emplace_back();
+					}
+
+					n = next;
+				}
+
+				nodes[n].end = true;
+			}
+
+			template < typename IT > bool Match(IT begin, IT end) const
+			{
+				return Match(begin, end, [](uint8_t c) { return c; });
+			}
+
+			template < typename IT, typename F > bool Match(IT begin, IT end, F&& f) const
+			{
+				uint32_t n = 0;
+
+				if (nodes[0].end)
+					return true;
+
+				for (auto i = begin; i != end; i++)
+				{
+					n = child(n, f((uint8_t)*i));
+
+					if (!n)
+						return false;
+
+					if (nodes[n].end)
+						return true;
+				}
+
+				return false;
+			}
+		};
+
+		//Exclusion rules compiled once per backup:
+		//file names are matched exactly, path rules are prefixes of the relative name, glob rules cover the whole name ( match::glob ).
+		//Globs of the form *literal, the common *.ext, go into a trie of reversed suffixes. Only the remaining globs are tried one by one.
+		//
+
+		class Rules
+		{
+			std::set<std::string, std::less<>> files;
+
+			Trie prefixes;
+			Trie suffixes;
+
+			std::vector<std::string> globs;
+
+		public:
+			Rules() { }
+
+			template < typename J > Rules(J& map)
+			{
+				map("file").ForEachValue([&](auto key, auto value)
+				{
+					bool on = value;
+
+					if (on)
+						File(std::string_view((const char*)key.data(), key.size()));
+				});
+
+				map("path").ForEachValue([&](auto key, auto value)
+				{
+					Path(std::string_view((const char*)key.data(), key.size()));
+				});
+
+				map("glob").ForEachValue([&](auto key, auto value)
+				{
+					Glob(std::string_view((const char*)key.data(), key.size()));
+				});
+			}
+
+			void File(std::string_view name)
+			{
+				files.emplace(name);
+			}
+
+			void Path(std::string_view prefix)
+			{
+				prefixes.Insert(prefix.begin(), prefix.end());
+			}
+
+			void Glob(std::string_view pattern)
+			{
+				if (pattern.size() > 1 && pattern[0] == '*' && pattern.find_first_of("*?", 1) == std::string_view::npos)
+				{
+					std::string folded;
+
+					for (auto i = pattern.rbegin(); i != pattern.rend() - 1; i++)
+						folded.push_back((char)match::fold((uint8_t)*i));
+
+					suffixes.Insert(folded.begin(), folded.end());
+				}
+				else
+					globs.emplace_back(pattern);
+			}
+
+			bool Empty() const
+			{
+				return !files.size() && prefixes.Empty() && suffixes.Empty() && !globs.size();
+			}
+
+			bool Excluded(std::string_view name) const
+			{
+				if (files.size() && files.find(name) != files.end())
+					return true;
+
+				if (prefixes.Match(name.begin(), name.end()))
+					return true;
+
+				if (suffixes.Match(name.rbegin(), name.rend(), [](uint8_t c) { return match::fold(c); }))
+					return true;
+
+				for (auto& g : globs)
+				{
+					if (match::glob(g, name))
+						return true;
+				}
+
+				return false;
+			}
+
+			//Everything below a directory matched by a path rule is excluded, it doesn't need to be walked:
+			//
+			bool Pruned(std::string_view directory) const
+			{
+				return prefixes.Match(directory.begin(), directory.end());
+			}
+		};
+	}
+}
@@ -0,0 +1,465 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+
+#include "backup.hpp"
+#include "delta.hpp"
+
+namespace dircopy
+{
+	namespace journal
+	{
+		using namespace defs;
+		using namespace d8u::util;
+
+		//Change journal kept in the snapshot folder, one line per entry: a tag and a name relative to the watched path, named as backups name files.
+		//F a file changed, D a directory appeared, moved or vanished and its whole subtree is walked, O events were lost and the next backup walks everything.
+		//
+
+		constexpr std::string_view LOG = "/journal.log";
+		constexpr std::string_view CONSUMED = "/journal.consumed";
+		constexpr std::string_view LOCK = "/journal.lock";
+
+		//Appends under an exclusive lock of the log itself, the backup taking the log waits for a write in progress.
+		//A log renamed away between open and lock was already taken, it is opened again.
+		//
+		inline bool append(const std::string& name, const std::string& data)
+		{
+			int fd = -1;
+
+			for (;;)
+			{
+				fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+				if (fd < 0)
+					return false;
+
+				::flock(fd, LOCK_EX);
+
+				struct stat opened, current;
+
+				if (::fstat(fd, &opened) == 0 && ::stat(name.c_str(), &current) == 0 && opened.st_ino == current.st_ino && opened.st_dev == current.st_dev)
+					break;
+
+				::close(fd);
+			}
+
+			size_t done = 0;
+
+			while (done < data.size())
+			{
+				auto w = ::write(fd, data.data() + done, data.size() - done);
+
+				if (w <= 0)
+					break;
+
+				done += (size_t)w;
+			}
+
+			::fsync(fd);
+			::close(fd);
+
+			return done == data.size();
+		}
+
+		//Recursive inotify watch of path, dirty names are written to the journal every INTERVAL.
+		//The journal lock is held while it runs, a backup that finds it free knows changes may have been missed.
+		//
+
+		class Watcher
+		{
+			static constexpr uint32_t MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+			std::string root;
+			std::string snapshot;
+
+			int fd = -1;
+			int lock = -1;
+
+			std::unordered_map<int, std::string> watches;
+
+			std::set<std::string> files;
+			std::set<std::string> directories;
+			bool overflow = true; //Nothing before the watch started is known
+
+			void watch(const std::string& rel)
+			{
+				auto wd = inotify_add_watch(fd, (root + rel).c_str(), MASK | IN_ONLYDIR);
+
+				if (wd < 0)
+				{
+					overflow = true; //Out of watches, see fs.inotify.max_user_watches
+					return;
+				}
+
+				watches[wd] = rel;
+			}
+
+			void watch_tree(const std::string& rel)
+			{
+				watch(rel);
+
+				std::error_code ec;
+
+				for (auto it = std::filesystem::recursive_directory_iterator(root + rel, std::filesystem::directory_options::skip_permission_denied, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+				{
+					if (!it->is_symlink(ec) && it->is_directory(ec))
+						watch(it->path().string().substr(root.size()));
+				}
+
+				if (ec)
+					overflow = true;
+			}
+
+			void event(const inotify_event* e)
+			{
+				if (e->mask & IN_Q_OVERFLOW)
+				{
+					overflow = true;
+					return;
+				}
+
+				auto it = watches.find(e->wd);
+
+				if (it == watches.end())
+					return;
+
+				if (e->mask & IN_IGNORED)
+				{
+					watches.erase(it);
+					return;
+				}
+
+				if (!e->len)
+					return;
+
+				auto name = (std::filesystem::path(root + it->second) / e->name).string().substr(root.size());
+
+				if (name.find('\n') != std::string::npos)
+				{
+					overflow = true;
+					return;
+				}
+
+				if (e->mask & IN_ISDIR)
+				{
+					if (e->mask & (IN_CREATE | IN_MOVED_TO))
+						watch_tree(name);
+
+					if (e->mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))
+						directories.insert(name);
+
+					return;
+				}
+
+				files.insert(name);
+			}
+
+			void flush()
+			{
+				if (!overflow && !files.size() && !directories.size())
+					return;
+
+				std::string data;
+
+				if (overflow)
+					data += "O\n";
+
+				for (auto& d : directories)
+					data += "D" + d + "\n";
+
+				for (auto& f : files)
+					data += "F" + f + "\n";
+
+				if (!append(snapshot + std::string(LOG), data))
+					return; //Kept until the next flush
+
+				overflow = false;
+				files.clear();
+				directories.clear();
+			}
+
+		public:
+			Watcher(std::string_view path, std::string_view _snapshot)
+				: root(path)
+				, snapshot(_snapshot)
+			{
+				std::filesystem::create_directories(snapshot);
+
+				lock = ::open((snapshot + std::string(LOCK)).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+				if (lock < 0 || ::flock(lock, LOCK_EX | LOCK_NB) != 0)
+				{
+					if (lock >= 0)
+						::close(lock);
+
+					throw std::runtime_error("A change journal is already running for this snapshot folder");
+				}
+
+				//Backups of any other path can't use this journal:
+				//
+
+				if (::ftruncate(lock, 0) != 0 || ::write(lock, root.data(), root.size()) != (ssize_t)root.size())
+				{
+					::close(lock);
+					throw std::runtime_error("Failed to write the journal lock");
+				}
+
+				fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+				if (fd < 0)
+				{
+					::close(lock);
+					throw std::runtime_error("Failed to start inotify");
+				}
+
+				watch_tree("");
+				flush();
+			}
+
+			~Watcher()
+			{
+				flush();
+
+				if (fd >= 0)
+					::close(fd);
+
+				if (lock >= 0)
+					::close(lock);
+			}
+
+			size_t Watches() { return watches.size(); }
+
+			void Run(std::atomic<bool>& running, size_t INTERVAL = 1000)
+			{
+				alignas(inotify_event) char buffer[64 * 1024];
+
+				auto last = std::chrono::steady_clock::now();
+
+				while (running)
+				{
+					pollfd p{ fd, POLLIN, 0 };
+
+					if (::poll(&p, 1, 100) > 0)
+					{
+						ssize_t length;
+
+						while ((length = ::read(fd, buffer, sizeof(buffer))) > 0)
+						{
+							for (char* e = buffer; e < buffer + length; e += sizeof(inotify_event) + ((inotify_event*)e)->len)
+								event((inotify_event*)e);
+						}
+					}
+
+					if (std::chrono::steady_clock::now() - last >= std::chrono::milliseconds(INTERVAL))
+					{
+						flush();
+						last = std::chrono::steady_clock::now();
+					}
+				}
+			}
+		};
+
+		struct Changes
+		{
+			bool complete = false;
+
+			std::set<std::string, std::less<>> files;
+			std::set<std::string, std::less<>> directories;
+		};
+
+		//Takes everything journaled since the last backup committed. Entries stay consumed until Commit, a failed backup takes them again.
+		//complete is only set when a watcher ran the whole time and lost nothing.
+		//
+		inline Changes Take(std::string_view _snapshot, std::string_view path)
+		{
+			Changes result;
+
+			auto snapshot = std::string(_snapshot);
+			auto log = snapshot + std::string(LOG);
+			auto consumed = snapshot + std::string(CONSUMED);
+
+			bool alive = false;
+			auto lock = ::open((snapshot + std::string(LOCK)).c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (lock >= 0)
+			{
+				alive = ::flock(lock, LOCK_SH | LOCK_NB) != 0;
+				::close(lock);
+			}
+
+			if (alive)
+			{
+				std::ifstream watched(snapshot + std::string(LOCK), std::ios::binary);
+				std::string root((std::istreambuf_iterator<char>(watched)), std::istreambuf_iterator<char>());
+
+				alive = root == path;
+			}
+
+			if (std::filesystem::exists(log))
+			{
+				auto next = consumed + ".next";
+
+				std::filesystem::rename(log, next);
+
+				{
+					auto fd = ::open(next.c_str(), O_RDONLY | O_CLOEXEC);
+
+					if (fd >= 0)
+					{
+						::flock(fd, LOCK_EX); //Waits for a write in progress
+						::close(fd);
+					}
+
+					std::ifstream input(next, std::ios::binary);
+					std::ofstream output(consumed, std::ios::binary | std::ios::app);
+
+					output << input.rdbuf();
+				}
+
+				std::filesystem::remove(next);
+			}
+
+			bool overflow = false;
+
+			std::ifstream input(consumed, std::ios::binary);
+			std::string line;
+
+			while (std::getline(input, line))
+			{
+				if (!line.size())
+					continue;
+
+				switch (line[0])
+				{
+				case 'F': result.files.insert(line.substr(1)); break;
+				case 'D': result.directories.insert(line.substr(1)); break;
+				default: overflow = true; break;
+				}
+			}
+
+			result.complete = alive && !overflow;
+
+			return result;
+		}
+
+		inline void Commit(std::string_view snapshot)
+		{
+			std::error_code ec;
+			std::filesystem::remove(std::string(snapshot) + std::string(CONSUMED), ec);
+		}
+
+		//Journal driven backup:
+		//Records of files the journal doesn't mention are carried from latest.db without a stat, only listed files and directories are walked.
+		//Falls back to walking the whole folder when the journal is incomplete or there is no previous backup.
+		//
+
+		template < bool MMAP = true, typename TH, typename STORE, typename ON_FILE, typename D > TH journal_folder2(std::string_view exclude, std::string_view delta_folder, Statistics& stats, std::string_view path, STORE& store, ON_FILE&& on_file, const D& domain = default_domain, size_t FILES = 1, size_t BLOCK = 1024 * 1024, size_t THREADS = 1, int compression = 5, size_t GROUP = 1, size_t LARGE_THRESHOLD = 128 * 1024 * 1024, size_t MAX_MEMORY = 128 * 1024 * 1024, bool sequence = false, bool index = false)
+		{
+			auto changes = Take(delta_folder, path);
+
+			if (!changes.complete || !std::filesystem::exists(std::string(delta_folder) + "/latest.db"))
+			{
+				std::cout << "Change journal incomplete, walking the whole folder..." << std::endl;
+
+				auto key = backup::recursive_folder2<MMAP, TH>(exclude, delta_folder, stats, path, store, on_file, domain, FILES, BLOCK, THREADS, compression, GROUP, LARGE_THRESHOLD, "", 0, MAX_MEMORY, sequence, index);
+
+				Commit(delta_folder);
+
+				return key;
+			}
+
+			delta::Path<TH> db(delta_folder, exclude, true);
+
+			db.OpenForWriting();
+
+			auto dirty = [&](std::string_view name)
+			{
+				if (changes.files.find(name) != changes.files.end())
+					return true;
+
+				for (auto d = delta::Path<TH>::Parent(name); d.size(); d = delta::Path<TH>::Parent(d))
+				{
+					if (changes.directories.find(d) != changes.directories.end())
+						return true;
+				}
+
+				return false;
+			};
+
+			db.Carry([&](auto name, auto size)
+			{
+				if (dirty(name))
+					return false;
+
+				stats.atomic.items++;
+				stats.atomic.read += size;
+				stats.atomic.blocks += (size / BLOCK + ((size % BLOCK) ? 1 : 0));
+
+				return true;
+			});
+
+			std::vector<std::filesystem::directory_entry> entries;
+			std::set<std::string, std::less<>> listed;
+
+			for (auto& d : changes.directories)
+			{
+				std::error_code ec;
+
+				for (auto it = std::filesystem::recursive_directory_iterator(std::string(path) + d, std::filesystem::directory_options::skip_permission_denied, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+				{
+					if (it->is_regular_file(ec) && listed.insert(it->path().string().substr(path.size())).second)
+						entries.push_back(*it);
+				}
+			}
+
+			for (auto& f : changes.files)
+			{
+				if (listed.find(f) != listed.end())
+					continue;
+
+				std::error_code ec;
+				std::filesystem::directory_entry e(std::string(path) + f, ec);
+
+				if (!ec && e.is_regular_file(ec))
+					entries.push_back(e);
+			}
+
+			backup::core_entries<MMAP>(db, stats, path, entries, store, on_file, domain, FILES, BLOCK, THREADS, compression, GROUP, LARGE_THRESHOLD, MAX_MEMORY, sequence, index);
+
+			db.Directories();
+			db.Statistics(stats, domain);
+
+			stats.atomic.files++;
+
+			auto key = backup::submit_file2<MMAP, TH>(stats, db.Finalize(), store, domain, BLOCK, THREADS, compression, GROUP);
+
+			Commit(delta_folder);
+
+			return key;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,245 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+
+#include "../mio.hpp"
+
+namespace dircopy
+{
+	namespace ledger
+	{
+		//Deep verification implies shallow:
+		//
+		enum Depth : uint64_t
+		{
+			shallow = 1,
+			deep = 2
+		};
+
+		//Local record of when each block id was last verified, kept in the snapshot folder.
+		//The file is an open addressing table mapped in place, it is rebuilt when a run could overfill it or when it holds entries that aged out.
+		//With a max_age, entries no run could still find fresh are dropped on every rebuild, so the table stays sized to the live set.
+		//
+
+		template <typename TH> class Ledger
+		{
+			static constexpr uint64_t MAGIC = 0x31305247444c4344; //DCLDGR01
+
+			struct Header
+			{
+				uint64_t magic;
+				uint64_t capacity;
+				uint64_t used;
+			};
+
+			//Last verification time per depth, zero when never verified that deep:
+			//
+			struct Entry
+			{
+				uint8_t id[sizeof(TH)];
+				uint64_t shallow;
+				uint64_t deep;
+
+				bool empty() const { return !shallow && !deep; }
+			};
+
+			std::string path;
+			uint64_t max_age;
+
+			mio::mmap_sink map;
+			std::mutex lock;
+
+			Header* header() { return (Header*)map.data(); }
+			Entry* entries() { return (Entry*)(map.data() + sizeof(Header)); }
+
+			static uint64_t bytes(uint64_t capacity) { return sizeof(Header) + capacity * sizeof(Entry); }
+
+			static void create(const std::string& name, uint64_t capacity)
+			{
+				{
+					std::ofstream output(name, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create ledger");
+
+					Header h{ MAGIC, capacity, 0 };
+					output.write((const char*)&h, sizeof(h));
+				}
+
+				std::filesystem::resize_file(name, bytes(capacity));
+			}
+
+			static Entry* slot(Header* h, Entry* e, const uint8_t* id)
+			{
+				uint64_t start;
+				std::memcpy(&start, id, sizeof(start));
+
+				auto mask = h->capacity - 1;
+
+				for (uint64_t i = start & mask, n = 0; n < h->capacity; i = (i + 1) & mask, n++)
+				{
+					if (e[i].empty() || std::memcmp(e[i].id, id, sizeof(TH)) == 0)
+						return e + i;
+				}
+
+				return nullptr;
+			}
+
+			bool stale(const Entry& e, uint64_t now)
+			{
+				return max_age && std::max(e.shallow, e.deep) + max_age < now;
+			}
+
+			bool valid()
+			{
+				return map.size() >= sizeof(Header) && header()->magic == MAGIC && map.size() == bytes(header()->capacity);
+			}
+
+			//Copies every live entry into a table with the new capacity and swaps it in:
+			//
+			void rebuild(uint64_t capacity, uint64_t now)
+			{
+				auto next = path + ".tmp";
+
+				create(next, capacity);
+
+				{
+					mio::mmap_sink target(next);
+
+					auto h = (Header*)target.data();
+					auto e = (Entry*)(target.data() + sizeof(Header));
+
+					if (map.is_open() && valid())
+					{
+						for (uint64_t i = 0; i < header()->capacity; i++)
+						{
+							auto& old = entries()[i];
+
+							if (old.empty() || stale(old, now))
+								continue;
+
+							*slot(h, e, old.id) = old;
+							h->used++;
+						}
+					}
+
+					std::error_code ec;
+					target.sync(ec);
+				}
+
+				map.unmap();
+
+				std::filesystem::rename(next, path);
+
+				map = mio::mmap_sink(path);
+			}
+
+		public:
+			//now and max_age are those of the run, a max_age of 0 keeps every entry:
+			//
+			Ledger(std::string_view _path, uint64_t expected, uint64_t now = 0, uint64_t _max_age = 0)
+				: path(_path)
+				, max_age(_max_age)
+			{
+				uint64_t capacity = 1024;
+
+				if (std::filesystem::exists(path) && std::filesystem::file_size(path) >= sizeof(Header))
+					map = mio::mmap_sink(path);
+
+				uint64_t used = 0, live = 0;
+
+				if (map.is_open() && valid())
+				{
+					used = live = header()->used;
+
+					if (max_age)
+					{
+						live = 0;
+
+						for (uint64_t i = 0; i < header()->capacity; i++)
+						{
+							if (!entries()[i].empty() && !stale(entries()[i], now))
+								live++;
+						}
+					}
+				}
+
+				while (capacity < (live + expected) * 2)
+					capacity *= 2;
+
+				if (!map.is_open() || !valid() || header()->capacity < capacity || header()->capacity > capacity * 2 || live < used)
+					rebuild(capacity, now);
+			}
+
+			~Ledger()
+			{
+				Flush();
+			}
+
+			void Flush()
+			{
+				std::error_code ec;
+				map.sync(ec);
+			}
+
+			size_t Size() { return header()->used; }
+
+			//True when the id was verified at depth or deeper within max_age seconds of now:
+			//
+			bool Fresh(const TH& id, uint64_t depth, uint64_t now, uint64_t max_age)
+			{
+				if (!max_age)
+					return false;
+
+				std::lock_guard<std::mutex> guard(lock);
+
+				auto e = slot(header(), entries(), id.data());
+
+				if (!e || e->empty())
+					return false;
+
+				auto time = (depth == deep) ? e->deep : std::max(e->shallow, e->deep);
+
+				return time && time + max_age >= now;
+			}
+
+			void Record(const TH& id, uint64_t depth, uint64_t now)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				auto e = slot(header(), entries(), id.data());
+
+				if (!e)
+					return; //Full, the block is simply verified again next run
+
+				if (e->empty())
+				{
+					//Grown before it passes 75% full, more blocks were seen than the run expected:
+					//
+
+					if ((header()->used + 1) * 4 > header()->capacity * 3)
+					{
+						rebuild(header()->capacity * 2, now);
+						e = slot(header(), entries(), id.data());
+					}
+
+					std::memcpy(e->id, id.data(), sizeof(TH));
+					header()->used++;
+				}
+
+				if (depth == deep)
+					e->deep = now;
+				else
+					e->shallow = now;
+			}
+		};
+	}
+}
@@ -0,0 +1,331 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <array>
+#include <queue>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <memory>
+
+#include "d8u/transform.hpp"
+#include "d8u/util.hpp"
+#include "d8u/async.hpp"
+
+#include "../mio.hpp"
+
+#include "defs.hpp"
+#include "delta.hpp"
+#include "restore.hpp"
+
+namespace dircopy
+{
+	namespace mark
+	{
+		using namespace defs;
+		using namespace d8u::util;
+		using namespace d8u::transform;
+
+		//Block ids are collected into sorted runs of at most MEMORY bytes, spilled next to the output and merged once at the end.
+		//The output is every unique id in ascending byte order, sizeof(TH) bytes each and nothing else.
+		//
+
+		template <typename TH> class Sorter
+		{
+			using Id = std::array<uint8_t, sizeof(TH)>;
+
+			std::string path;
+			size_t limit;
+
+			std::vector<Id> buffer;
+			std::vector<std::string> runs;
+			std::mutex lock;
+
+			void spill()
+			{
+				std::sort(buffer.begin(), buffer.end());
+				buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+
+				if (!buffer.size())
+					return;
+
+				auto name = path + ".run" + std::to_string(runs.size());
+
+				{
+					std::ofstream output(name, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create mark run");
+
+					output.write((const char*)buffer.data(), buffer.size() * sizeof(Id));
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write mark run");
+				}
+
+				runs.push_back(name);
+				buffer.clear();
+			}
+
+		public:
+			Sorter(std::string_view _path, uint64_t MEMORY = 1024 * 1024 * 1024)
+				: path(_path)
+				, limit((size_t)std::max<uint64_t>(MEMORY / sizeof(Id), 1024))
+			{
+				buffer.reserve(std::min<size_t>(limit, 1024 * 1024));
+			}
+
+			~Sorter()
+			{
+				std::error_code ec;
+				for (auto& r : runs)
+					std::filesystem::remove(r, ec);
+			}
+
+			void Add(const TH& id)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				buffer.emplace_back();
+				std::memcpy(buffer.back().data(), id.data(), sizeof(Id));
+
+				if (buffer.size() >= limit)
+					spill();
+			}
+
+			//Merges the runs into path, returns the number of unique ids:
+			//
+			uint64_t Finish()
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				spill();
+
+				struct Run
+				{
+					std::ifstream input;
+					Id head;
+
+					bool Next() { return (bool)input.read((char*)head.data(), sizeof(Id)); }
+				};
+
+				std::vector<std::unique_ptr<Run>> inputs;
+
+				using Entry = std::pair<Id, size_t>;
+				std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+
+				for (auto& r : runs)
+				{
+					inputs.push_back(std::make_unique<Run>());
+					inputs.back()->input.open(r, std::ios::binary);
+
+					if (!inputs.back()->input.is_open())
+						throw std::runtime_error("Failed to open mark run");
+
+					if (inputs.back()->Next())
+						heap.push(std::make_pair(inputs.back()->head, inputs.size() - 1));
+				}
+
+				auto partial = path + ".partial";
+				uint64_t count = 0;
+
+				{
+					std::ofstream output(partial, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create mark output");
+
+					Id last;
+
+					while (heap.size())
+					{
+						auto [id, i] = heap.top();
+						heap.pop();
+
+						if (!count || id != last)
+						{
+							output.write((const char*)id.data(), sizeof(Id));
+							last = id;
+							count++;
+						}
+
+						if (inputs[i]->Next())
+							heap.push(std::make_pair(inputs[i]->head, i));
+					}
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write mark output");
+				}
+
+				std::filesystem::remove(path);
+				std::filesystem::rename(partial, path);
+
+				return count;
+			}
+		};
+
+		//The sorted id file as written by Sorter, what a store side sweep checks each stored block against:
+		//
+		template <typename TH> class Live
+		{
+			mio::mmap_source map;
+
+		public:
+			Live(std::string_view path)
+			{
+				if (std::filesystem::file_size(path) % sizeof(TH) != 0)
+					throw std::runtime_error("Malformed Mark File");
+
+				if (std::filesystem::file_size(path))
+					map = mio::mmap_source(std::string(path));
+			}
+
+			uint64_t Size() { return map.size() / sizeof(TH); }
+
+			bool Contains(const TH& id)
+			{
+				auto data = (const uint8_t*)map.data();
+				uint64_t l = 0, r = Size();
+
+				while (l < r)
+				{
+					auto m = (l + r) / 2;
+					auto c = std::memcmp(data + m * sizeof(TH), id.data(), sizeof(TH));
+
+					if (c == 0)
+						return true;
+
+					if (c < 0)
+						l = m + 1;
+					else
+						r = m;
+				}
+
+				return false;
+			}
+		};
+
+		struct Marked
+		{
+			uint64_t snapshots = 0;
+			uint64_t files = 0;
+			uint64_t referenced = 0;
+			uint64_t live = 0;
+		};
+
+		//Mark phase of garbage collection:
+		//Every block reachable from the folder keys is written to output, the folder record, the folder database, file blocks and key lists.
+		//Only metadata is read, key lists of large files are fetched by P threads. A block that can't be read fails the whole mark, a partial live set would let a sweep delete live data.
+		//
+
+		template <typename TH, typename S, typename D> Marked core_mark(Statistics& s, const std::vector<TH>& folder_keys, S& store, const D& domain, std::string_view output, size_t P = 1, uint64_t MEMORY = 1024 * 1024 * 1024)
+		{
+			Sorter<TH> sorter(output, MEMORY);
+			Marked result;
+
+			std::atomic<uint64_t> referenced = 0;
+			std::atomic<bool> failed = false;
+
+			auto add = [&](const TH& key)
+			{
+				referenced++;
+				sorter.Add(key.GetNext());
+			};
+
+			{
+				d8u::async::Pipeline<TH, 2> list_pipeline;
+
+				list_pipeline.Start([&](auto& prev, auto& next)
+				{
+					try
+					{
+						for (auto& folder_key : folder_keys)
+						{
+							add(folder_key);
+
+							auto folder_record = restore::list(s, folder_key, store, domain, true, add);
+							auto record_keys = span<TH>((TH*)folder_record.data(), folder_record.size() / sizeof(TH));
+
+							for (size_t i = 0; i + 1 < record_keys.size() /*Last hash is the file hash*/; i++)
+								add(record_keys[i]);
+
+							restore::Database<TH> db(s, folder_key, store, domain, true, true, P);
+
+							db.Iterate([&](uint64_t p)
+							{
+								auto [size, time, name, keys] = db.Record(p);
+
+								if (!size || delta::Path<>::Internal(name))
+									return true;
+
+								result.files++;
+
+								if (keys.size() == 1)
+								{
+									add(*keys.data());
+									next.Push(TH(*keys.data()), 4096);
+								}
+								else
+								{
+									for (size_t i = 0; i + 1 < keys.size() /*Last hash is the file hash*/; i++)
+										add(keys[i]);
+								}
+
+								return true;
+							});
+
+							result.snapshots++;
+						}
+					}
+					catch (...)
+					{
+						failed = true;
+					}
+				});
+
+				list_pipeline.Stream([&](auto&& key, auto& next)
+				{
+					try
+					{
+						auto list = restore::list(s, key, store, domain, true, add);
+
+						for (size_t i = 0; i + 1 < list.size() / sizeof(TH) /*Last hash is the file hash*/; i++)
+							add(((TH*)list.data())[i]);
+					}
+					catch (...)
+					{
+						failed = true;
+					}
+
+					return true;
+				}, P);
+			}
+
+			if (failed)
+				throw std::runtime_error("Incomplete Mark");
+
+			result.referenced = referenced;
+			result.live = sorter.Finish();
+
+			return result;
+		}
+
+		template <typename TH, typename S, typename D> std::pair<bool, Marked> mark2(Statistics& s, const std::vector<TH>& folder_keys, S& store, const D& domain, std::string_view output, size_t P = 1, uint64_t MEMORY = 1024 * 1024 * 1024)
+		{
+			try
+			{
+				return std::make_pair(true, core_mark(s, folder_keys, store, domain, output, P, MEMORY));
+			}
+			catch (...) {}
+
+			return std::make_pair(false, Marked());
+		}
+	}
+}
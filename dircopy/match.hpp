@@ -0,0 +1,252 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+namespace dircopy
+{
+	namespace match
+	{
+		//ASCII case folding only, bytes of multi byte UTF-8 sequences are compared exactly and never match inside another sequence.
+		//
+
+		inline uint8_t fold(uint8_t c)
+		{
+			return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		}
+
+		inline bool equal_folded(const uint8_t* hay, const uint8_t* needle, size_t size)
+		{
+			for (size_t i = 0; i < size; i++)
+			{
+				if (fold(hay[i]) != needle[i])
+					return false;
+			}
+
+			return true;
+		}
+
+		class Pattern
+		{
+			std::string folded;
+
+		public:
+			Pattern(std::string_view target)
+			{
+				folded.reserve(target.size());
+
+				for (auto c : target)
+					folded.push_back((char)fold((uint8_t)c));
+			}
+
+			size_t size() const { return folded.size(); }
+			const uint8_t* data() const { return (const uint8_t*)folded.data(); }
+
+			uint8_t first() const { return data()[0]; }
+			uint8_t last() const { return data()[size() - 1]; }
+		};
+
+		inline uint32_t lowest(uint32_t mask)
+		{
+#ifdef _WIN32
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+
+			return (uint32_t)bit;
+#else
+			return (uint32_t)__builtin_ctz(mask);
+#endif
+		}
+
+		//Candidates are positions where both the first and last byte of the pattern match, only those are compared in full:
+		//
+
+		inline bool scalar(const uint8_t* hay, size_t size, const Pattern& p, size_t start = 0)
+		{
+			auto n = p.size();
+
+			for (size_t i = start; i + n <= size; i++)
+			{
+				if (fold(hay[i]) == p.first() && fold(hay[i + n - 1]) == p.last() && equal_folded(hay + i + 1, p.data() + 1, n - 1))
+					return true;
+			}
+
+			return false;
+		}
+
+#if defined(__AVX2__)
+
+		inline __m256i fold(__m256i v)
+		{
+			auto shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'A')));
+			auto upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), shifted);
+
+			return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+		}
+
+		inline bool simd(const uint8_t* hay, size_t size, const Pattern& p)
+		{
+			auto n = p.size();
+			auto first = _mm256_set1_epi8((char)p.first());
+			auto last = _mm256_set1_epi8((char)p.last());
+
+			size_t i = 0;
+
+			for (; i + n - 1 + 32 <= size; i += 32)
+			{
+				auto head = fold(_mm256_loadu_si256((const __m256i*)(hay + i)));
+				auto tail = fold(_mm256_loadu_si256((const __m256i*)(hay + i + n - 1)));
+
+				uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+
+				while (mask)
+				{
+					auto bit = lowest(mask);
+
+					if (equal_folded(hay + i + bit + 1, p.data() + 1, n - 1))
+						return true;
+
+					mask &= mask - 1;
+				}
+			}
+
+			return scalar(hay, size, p, i);
+		}
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+		inline __m128i fold(__m128i v)
+		{
+			auto shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A')));
+			auto upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+
+			return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+		}
+
+		inline bool simd(const uint8_t* hay, size_t size, const Pattern& p)
+		{
+			auto n = p.size();
+			auto first = _mm_set1_epi8((char)p.first());
+			auto last = _mm_set1_epi8((char)p.last());
+
+			size_t i = 0;
+
+			for (; i + n - 1 + 16 <= size; i += 16)
+			{
+				auto head = fold(_mm_loadu_si128((const __m128i*)(hay + i)));
+				auto tail = fold(_mm_loadu_si128((const __m128i*)(hay + i + n - 1)));
+
+				uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+
+				while (mask)
+				{
+					auto bit = lowest(mask);
+
+					if (equal_folded(hay + i + bit + 1, p.data() + 1, n - 1))
+						return true;
+
+					mask &= mask - 1;
+				}
+			}
+
+			return scalar(hay, size, p, i);
+		}
+
+#else
+
+		inline bool simd(const uint8_t* hay, size_t size, const Pattern& p)
+		{
+			return scalar(hay, size, p);
+		}
+
+#endif
+
+		inline bool contains(std::string_view hay, const Pattern& p)
+		{
+			if (!p.size())
+				return true;
+
+			if (hay.size() < p.size())
+				return false;
+
+			return simd((const uint8_t*)hay.data(), hay.size(), p);
+		}
+
+		//Wildcard match over the whole name, * spans any run of bytes and ? a single byte. Case folded like contains:
+		//
+		inline bool glob(std::string_view pattern, std::string_view name)
+		{
+			size_t p = 0, n = 0, star = std::string_view::npos, resume = 0;
+
+			while (n < name.size())
+			{
+				if (p < pattern.size() && pattern[p] == '*')
+				{
+					star = p++;
+					resume = n;
+				}
+				else if (p < pattern.size() && (pattern[p] == '?' || fold((uint8_t)pattern[p]) == fold((uint8_t)name[n])))
+				{
+					p++;
+					n++;
+				}
+				else if (star != std::string_view::npos)
+				{
+					p = star + 1;
+					n = ++resume;
+				}
+				else
+					return false;
+			}
+
+			while (p < pattern.size() && pattern[p] == '*')
+				p++;
+
+			return p == pattern.size();
+		}
+
+		//Several patterns matched against each name in one pass, f(index) is called for every pattern found:
+		//
+		class Set
+		{
+			std::vector<Pattern> patterns;
+
+		public:
+			Set(const std::vector<std::string>& targets)
+			{
+				for (auto& t : targets)
+					patterns.emplace_back(t);
+			}
+
+			size_t size() const { return patterns.size(); }
+
+			template < typename F > size_t Each(std::string_view hay, F&& f) const
+			{
+				size_t found = 0;
+
+				for (size_t i = 0; i < patterns.size(); i++)
+				{
+					if (contains(hay, patterns[i]))
+					{
+						found++;
+						f(i);
+					}
+				}
+
+				return found;
+			}
+		};
+	}
+}
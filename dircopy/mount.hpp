@@ -2,6 +2,14 @@
 
 #pragma once
 
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <algorithm>
+#include <set>
+
 #include "d8u/util.hpp"
 #include "d8u/transform.hpp"
 
@@ -9,6 +17,9 @@
 
 #include "restore.hpp"
 #include "delta.hpp"
+#include "trigram.hpp"
+#include "match.hpp"
+#include "schedule.hpp"
 
 namespace dircopy
 {
@@ -17,27 +28,107 @@ namespace dircopy
 		using namespace d8u::util;
 		using namespace d8u::transform;
 
+		//Decoded blocks shared by the reads of a Path, least recently used blocks are dropped past LIMIT bytes:
+		//
+		class BlockCache
+		{
+			using Block = std::shared_ptr<const d8u::sse_vector>;
+
+			std::list<std::pair<std::string, Block>> order;
+			std::unordered_map<std::string, std::list<std::pair<std::string, Block>>::iterator> index;
+
+			std::mutex lock;
+
+			uint64_t used = 0;
+			uint64_t LIMIT;
+
+		public:
+			BlockCache(uint64_t _LIMIT = 256 * 1024 * 1024)
+				: LIMIT(_LIMIT) { }
+
+			Block Get(const std::string& id)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				auto it = index.find(id);
+
+				if (it == index.end())
+					return nullptr;
+
+				order.splice(order.begin(), order, it->second);
+
+				return it->second->second;
+			}
+
+			void Put(const std::string& id, Block block)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				if (index.find(id) != index.end())
+					return;
+
+				order.emplace_front(id, block);
+				index[id] = order.begin();
+				used += block->size();
+
+				while (used > LIMIT && order.size() > 1)
+				{
+					used -= order.back().second->size();
+					index.erase(order.back().first);
+					order.pop_back();
+				}
+			}
+		};
+
 		template < typename TH, typename S, typename D > class Path
 		{
 			S & store;
 			D & domain;
 			Statistics stats;
 
-			tdb::MemoryHashmap db;
+			restore::Database<TH> db;
 
 			bool validate;
 
+			size_t BLOCK;
+			size_t AHEAD;
+
+			BlockCache blocks;
+
+			std::string last_name;
+			uint64_t last_end = 0;
+			std::future<void> prefetch;
+
+			std::unique_ptr<trigram::Index> names;
+
+			std::shared_ptr<const d8u::sse_vector> block(const TH& key)
+			{
+				auto id = key.GetNext();
+				auto name = std::string((const char*)id.data(), sizeof(TH));
+
+				if (auto cached = blocks.Get(name))
+					return cached;
+
+				auto result = std::make_shared<const d8u::sse_vector>(restore::block(stats, key, store, domain, validate));
+				blocks.Put(name, result);
+
+				return result;
+			}
+
 		public:
-			Path(const TH & folder_key, S & _s, D& _d, bool v = true)
+			Path(const TH & folder_key, S & _s, D& _d, bool v = true, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024, uint64_t MEMORY = 256 * 1024 * 1024, size_t _BLOCK = 1024 * 1024, size_t _AHEAD = 8)
 				: store(_s)
 				, domain(_d)
+				, db(stats, folder_key, _s, _d, v, v, 1, cache, CACHE)
 				, validate(v)
-			{
-				auto folder_record = restore::block(stats, folder_key, store, domain, validate);
+				, BLOCK(_BLOCK)
+				, AHEAD(_AHEAD)
+				, blocks(MEMORY) { }
 
-				auto database = restore::file_memory(stats, gsl::span<TH>((TH*)folder_record.data(), folder_record.size() / sizeof(TH)), store, domain, validate, validate);
-
-				db.Open(database);
+			~Path()
+			{
+				if (prefetch.valid())
+					prefetch.wait();
 			}
 
 			auto Usage()
@@ -56,53 +147,328 @@ namespace dircopy
 			{
 				return (size_t) db.Iterate([&, f = std::move(f)](uint64_t p)
 				{
-					auto [size, time, name, keys] = delta::Path<TH>::Decode(db.GetObject(p));
+					auto [size, time, name, keys] = db.Record(p);
+
+					if (delta::Path<TH>::Internal(name))
+						return true;
 
 					return f(size,time,name,keys);
 				});
 			}
 
+			//The trigram index is built on first use, with a cache folder it is kept next to the cached database.
+			//Targets shorter than a trigram scan every record.
+			//
 			template < typename F > size_t Search(std::string_view target, F&& f)
 			{
 				size_t total = 0;
+				match::Pattern pattern(target);
 
-				db.Iterate([&, f = std::move(f)](uint64_t p)
+				auto found = [&](uint64_t p)
 				{
-					auto [size, time, name, keys] = delta::Path<TH>::Decode(db.GetObject(p));
+					auto [size, time, name, keys] = db.Record(p);
 
-					auto it = std::search(name.begin(), name.end(), target.begin(), target.end(), [](char ch1, char ch2) { return std::tolower(ch1) == std::tolower(ch2); });
+					if (delta::Path<TH>::Internal(name))
+						return true;
 
-					if (it != name.end())
+					if (match::contains(name, pattern))
 					{
 						total++;
 						return f(size, time, name, keys);
 					}
 
 					return true;
+				};
+
+				if (target.size() < 3)
+				{
+					db.Iterate(found);
+					return total;
+				}
+
+				if (!names)
+					names = std::make_unique<trigram::Index>(db, db.Cached() ? std::filesystem::path(db.Path()).replace_extension(".tri").string() : std::string());
+
+				for (auto p : names->Candidates(target))
+				{
+					if (!found(p))
+						break;
+				}
+
+				return total;
+			}
+
+			//Several targets in one scan, f(index of target, size, time, name, keys):
+			//
+			template < typename F > size_t Search(const std::vector<std::string>& targets, F&& f)
+			{
+				size_t total = 0;
+				match::Set patterns(targets);
+
+				db.Iterate([&](uint64_t p)
+				{
+					auto [size, time, name, keys] = db.Record(p);
+
+					if (delta::Path<TH>::Internal(name))
+						return true;
+
+					bool next = true;
+
+					total += patterns.Each(name, [&](size_t i)
+					{
+						next = next && f(i, size, time, name, keys);
+					});
+
+					return next;
 				});
 
 				return total;
 			}
 
-			std::vector<uint8_t> Memory(std::string_view name, size_t P = 4)
+			d8u::sse_vector Memory(std::string_view _name, size_t P = 4)
 			{
-				std::vector<uint8_t> temp;
-				auto p = db.Find(name);
+				d8u::sse_vector temp;
+				auto p = db.Find(_name);
 
 				if (!p)
-					return false;
-				
-				auto [size, time, name, keys] = delta::Path::Decode(db.GetObject(*p));
+					return {};
+
+				auto [size, time, name, keys] = db.Record(*p);
 
 				if (keys.size() == 1)
 				{
-					temp = restore::block(stats, *keys.data(), store, domain, P);
+					temp = restore::list(stats, *keys.data(), store, domain, validate);
 					keys = gsl::span<TH>((TH*)temp.data(), temp.size() / sizeof(TH));
 				}
-	
+
 				return restore::file_memory(stats, keys, store, domain, validate, validate);
 			}
 
+			//Lists one directory from the index written at backup time, dir is "" for the root.
+			//f(name, directory, size, last_write), directories report the total size below them.
+			//Returns false when the directory is not indexed, backups taken before the index existed only support Enumerate.
+			//
+			template < typename F > bool List(std::string_view dir, F&& f)
+			{
+				using P = delta::Path<TH>;
+
+				for (size_t chunk = 0;; chunk++)
+				{
+					auto p = db.Find(P::DirectoryRecord(dir, chunk));
+
+					if (!p)
+						return chunk > 0;
+
+					auto [_size, _time, _name, data] = P::DecodeRaw(db.GetObject(*p));
+
+					for (size_t i = chunk ? 0 : sizeof(uint64_t) * 3; i + 3 <= data.size();)
+					{
+						bool directory = data[i] == 1;
+						size_t length = data[i + 1] | (data[i + 2] << 8);
+
+						auto entry = std::string_view((const char*)data.data() + i + 3, length);
+						auto path = std::string(dir) + std::string(entry);
+
+						i += 3 + length;
+
+						uint64_t size = 0, time = 0;
+
+						if (directory)
+						{
+							if (auto d = db.Find(P::DirectoryRecord(path, 0)))
+							{
+								auto [ds, dt, dn, aggregate] = P::DecodeRaw(db.GetObject(*d));
+
+								if (aggregate.size() >= sizeof(uint64_t))
+									size = *(uint64_t*)aggregate.data();
+							}
+						}
+						else if (auto r = db.Find(path))
+						{
+							auto [fs, ft, fn, keys] = P::Decode(db.GetObject(*r));
+
+							size = fs;
+							time = ft;
+						}
+
+						if (!f(P::Leaf(entry), directory, size, time))
+							return true;
+					}
+				}
+			}
+
+			//Reads length bytes at offset, only the blocks covering the range are fetched.
+			//A read starting where the previous one ended prefetches the next AHEAD blocks.
+			//
+			std::vector<uint8_t> Read(std::string_view _name, uint64_t offset, uint64_t length)
+			{
+				std::vector<uint8_t> result;
+				auto p = db.Find(_name);
+
+				if (!p)
+					throw std::runtime_error("File not found");
+
+				auto [size, time, name, keys] = db.Record(*p);
+
+				if (offset >= size || !length)
+					return result;
+
+				length = std::min(length, size - offset);
+
+				std::shared_ptr<const d8u::sse_vector> list;
+
+				if (keys.size() == 1)
+				{
+					list = block(*keys.data());
+
+					if (list->size() % sizeof(TH) != 0)
+						throw std::runtime_error("Malformed File Record");
+
+					keys = gsl::span<TH>((TH*)list->data(), list->size() / sizeof(TH));
+				}
+
+				if (keys.size() <= 1)
+					throw std::runtime_error("Malformed Folder Record");
+
+				//A key tree is walked per block, only the nodes above the blocks read are fetched and they stay in the block cache:
+				//
+				bool nested = tree::Is(keys);
+
+				auto count = nested ? tree::Read(keys).blocks : keys.size() - 1; /*Last hash is the file hash*/
+				auto at = [&](uint64_t i)
+				{
+					return nested ? tree::Locate(keys, i, [&](const TH& k) { return block(k); }) : keys[i];
+				};
+
+				auto first = offset / BLOCK;
+				auto last = std::min<uint64_t>((offset + length - 1) / BLOCK, count - 1);
+
+				result.reserve(length);
+
+				for (auto i = first; i <= last; i++)
+				{
+					auto buffer = block(at(i));
+
+					auto start = (i == first) ? offset - i * BLOCK : 0;
+					auto end = std::min<uint64_t>(buffer->size(), offset + length - i * BLOCK);
+
+					if (start >= end)
+						break;
+
+					result.insert(result.end(), buffer->data() + start, buffer->data() + end);
+				}
+
+				bool sequential = last_name == _name && last_end == offset;
+
+				last_name = std::string(_name);
+				last_end = offset + result.size();
+
+				if (sequential && AHEAD && last + 1 < count)
+				{
+					if (prefetch.valid())
+						prefetch.wait();
+
+					std::vector<TH> ahead;
+
+					for (auto i = last + 1; i < std::min<uint64_t>(count, last + 1 + AHEAD); i++)
+						ahead.push_back(at(i));
+
+					prefetch = std::async(std::launch::async, [this, ahead = std::move(ahead)]()
+					{
+						try
+						{
+							for (auto& k : ahead)
+								block(k);
+						}
+						catch (...) {}
+					});
+				}
+
+				return result;
+			}
+
+			//Fetches several files under the dest folder with one block schedule, blocks shared between them are read once.
+			//Targets are names, directory prefixes ending in a separator, or patterns with * and ?.
+			//Returns the number of files fetched.
+			//
+			size_t Fetch(const std::vector<std::string>& targets, std::string_view dest, size_t P = 4, size_t WINDOW = 64 * 1024)
+			{
+				std::set<uint64_t> selected;
+				std::vector<std::string_view> patterns;
+
+				for (auto& t : targets)
+				{
+					if (t.find_first_of("*?") != std::string::npos || (t.size() && (t.back() == '\\' || t.back() == '/')))
+						patterns.push_back(t);
+					else if (auto p = db.Find(t))
+						selected.insert(*p);
+				}
+
+				if (patterns.size())
+				{
+					db.Iterate([&](uint64_t p)
+					{
+						auto [size, time, name, keys] = db.Record(p);
+
+						if (delta::Path<TH>::Internal(name))
+							return true;
+
+						for (auto& pattern : patterns)
+						{
+							bool prefix = pattern.back() == '\\' || pattern.back() == '/';
+
+							if (prefix ? name.substr(0, pattern.size()) == pattern : match::glob(pattern, name))
+							{
+								selected.insert(p);
+								break;
+							}
+						}
+
+						return true;
+					});
+				}
+
+				schedule::Plan<TH> plan(BLOCK);
+
+				auto flush = [&]()
+				{
+					if (!plan.Files())
+						return;
+
+					plan.Locate(store);
+					schedule::write(stats, dest, plan, store, domain, validate, validate, BLOCK, P);
+					plan.Clear();
+				};
+
+				for (auto p : selected)
+				{
+					auto [size, time, name, keys] = db.Record(p);
+
+					if (!size)
+					{
+						d8u::util::empty_file(std::string(dest) + "\\" + std::string(name));
+						continue;
+					}
+
+					std::shared_ptr<const d8u::sse_vector> list;
+
+					if (keys.size() == 1)
+					{
+						list = std::make_shared<const d8u::sse_vector>(restore::list(stats, *keys.data(), store, domain, validate));
+						keys = gsl::span<TH>((TH*)list->data(), list->size() / sizeof(TH));
+					}
+
+					plan.File(name, size, keys);
+
+					if (plan.Blocks() >= WINDOW)
+						flush();
+				}
+
+				flush();
+
+				return selected.size();
+			}
+
 			void Fetch(std::string_view _name, std::string_view dest, size_t P = 4)
 			{
 				d8u::sse_vector temp;
@@ -111,7 +477,7 @@ namespace dircopy
 				if (!p)
 					return;
 
-				auto [size, time, name, keys] = delta::Path<TH>::Decode(db.GetObject(*p));
+				auto [size, time, name, keys] = db.Record(*p);
 
 				if (keys.size() == 1)
 				{
@@ -4,15 +4,27 @@
 
 #include <string_view>
 #include <fstream>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+#include <random>
+#include <atomic>
 
 #include "d8u/transform.hpp"
 #include "defs.hpp"
 #include "delta.hpp"
+#include "tree.hpp"
 #include "d8u/memory.hpp"
 
 #include "d8u/util.hpp"
+#include "d8u/async.hpp"
 #include "../mio.hpp"
 
+#include "tdb/legacy.hpp"
+
 namespace dircopy
 {
 	namespace restore
@@ -44,6 +56,63 @@ namespace dircopy
 			return block;
 		}
 
+		//Visits the data keys of a key tree in order, one leaf at a time. on_node(key) sees every node below the root:
+		//
+		template <typename TH, typename S, typename D, typename F, typename N> void leaves(Statistics& s, span<TH> node, S& store, const D& domain, bool validate, F&& f, N&& on_node)
+		{
+			auto children = tree::Children(node);
+
+			if (!tree::Read(node).level)
+			{
+				f(children);
+				return;
+			}
+
+			for (auto& child : children)
+			{
+				on_node(child);
+
+				auto buffer = block(s, child, store, domain, validate);
+
+				if (buffer.size() % sizeof(TH) != 0 || !tree::Is(span<TH>((TH*)buffer.data(), buffer.size() / sizeof(TH))))
+					throw std::runtime_error("Malformed Key Tree");
+
+				leaves(s, span<TH>((TH*)buffer.data(), buffer.size() / sizeof(TH)), store, domain, validate, f, on_node);
+			}
+		}
+
+		//The key list of a file stored with one key, trees are read whole and flattened. Like a flat list it ends with the file hash:
+		//
+		template <typename TH, typename S, typename D, typename N> d8u::sse_vector list(Statistics& s, const TH& key, S& store, const D& domain, bool validate, N&& on_node)
+		{
+			auto root = block(s, key, store, domain, validate);
+
+			if (root.size() % sizeof(TH) != 0)
+				throw std::runtime_error("Malformed File Record");
+
+			auto keys = span<TH>((TH*)root.data(), root.size() / sizeof(TH));
+
+			if (!tree::Is(keys))
+				return root;
+
+			d8u::sse_vector result;
+			result.reserve((tree::Read(keys).blocks + 1) * sizeof(TH));
+
+			leaves(s, keys, store, domain, validate, [&](span<TH> data)
+			{
+				result.insert(result.end(), (uint8_t*)data.data(), (uint8_t*)(data.data() + data.size()));
+			}, on_node);
+
+			result.insert(result.end(), (uint8_t*)(keys.end() - 1), (uint8_t*)keys.end());
+
+			return result;
+		}
+
+		template <typename TH, typename S, typename D> d8u::sse_vector list(Statistics& s, const TH& key, S& store, const D& domain, bool validate = false)
+		{
+			return list(s, key, store, domain, validate, [](const TH&) {});
+		}
+
 		template <typename TH, typename S, typename D> d8u::sse_vector file_memory(Statistics& s, span<TH> keys, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false)
 		{
 			d8u::sse_vector result;
@@ -78,27 +147,12 @@ namespace dircopy
 			return result;
 		}
 
-		template <typename TH, typename S, typename D> void _file2(Statistics& s, std::string_view dest, span<TH> keys, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1)
+		template <typename TH, typename O, typename S, typename D, typename H> void _blocks(Statistics& s, O& output, span<TH> keys, H& state, S& store, const D& domain, bool validate_blocks, bool hash_file, size_t P)
 		{
-			typename TH::State state;
-
-			if (hash_file)
-				state.Update(domain);
-
-			std::filesystem::create_directories(std::filesystem::path(dest).parent_path().string());
-
-			std::ofstream output(dest, std::ios::binary);
-
-			if (!output.is_open())
-				throw std::runtime_error("Failed to create file");
-
 			if (P == 1)
 			{
 				for (auto& key : keys)
 				{
-					if (&key == keys.end() - 1)
-						break; //Last hash is the file hash
-
 					auto buffer = block(s,key, store, domain, validate_blocks);
 
 					if (hash_file)
@@ -112,7 +166,7 @@ namespace dircopy
 			else
 			{
 				std::atomic<int> local = 0;
-				std::vector<d8u::sse_vector> map; map.resize(keys.size() - 1);
+				std::vector<d8u::sse_vector> map; map.resize(keys.size());
 
 				std::thread io([&]()
 				{
@@ -132,7 +186,7 @@ namespace dircopy
 					}
 				});
 
-				for (size_t i = 0; i < keys.size() - 1; i++)
+				for (size_t i = 0; i < keys.size(); i++)
 				{
 					while (local.load() >= P)
 						std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -147,7 +201,26 @@ namespace dircopy
 				}
 
 				io.join();
+
+				while (local.load())
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
 			}
+		}
+
+		//Fetch the blocks of one file in order into output, anything with write(char*,size):
+		//A key tree is streamed leaf by leaf, the first bytes are written once the nodes down to the first leaf are read.
+		//
+		template <typename TH, typename O, typename S, typename D> void _stream(Statistics& s, O& output, span<TH> keys, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1)
+		{
+			typename TH::State state;
+
+			if (hash_file)
+				state.Update(domain);
+
+			if (tree::Is(keys))
+				leaves(s, keys, store, domain, validate_blocks, [&](span<TH> data) { _blocks(s, output, data, state, store, domain, validate_blocks, hash_file, P); }, [](const TH&) {});
+			else
+				_blocks(s, output, keys.first(keys.size() - 1) /*Last hash is the file hash*/, state, store, domain, validate_blocks, hash_file, P);
 
 			if (hash_file)
 			{
@@ -158,6 +231,18 @@ namespace dircopy
 			}
 		}
 
+		template <typename TH, typename S, typename D> void _file2(Statistics& s, std::string_view dest, span<TH> keys, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1)
+		{
+			std::filesystem::create_directories(std::filesystem::path(dest).parent_path().string());
+
+			std::ofstream output(std::string(dest), std::ios::binary);
+
+			if (!output.is_open())
+				throw std::runtime_error("Failed to create file");
+
+			_stream(s, output, keys, store, domain, validate_blocks, hash_file, P);
+		}
+
 		template <typename TH, typename S, typename D> void file2(Statistics& s, std::string_view dest, const TH& file_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1)
 		{
 			auto file_record = block(s,file_key, store, domain, validate_blocks);
@@ -170,31 +255,486 @@ namespace dircopy
 			_file2(s,dest, keys, store, domain, validate_blocks, hash_file, P);
 		}
 
-		template <typename TH, typename S, typename D> void folder2(Statistics & s,std::string_view dest, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
+		//Hash a restored file the same way backup did, one BLOCK at a time:
+		//
+		template <typename TH, typename D> bool file_matches(std::string_view path, const TH& file_hash, const D& domain, size_t BLOCK = 1024 * 1024)
 		{
-			auto folder_record = block(s, folder_key, store, domain, validate_blocks);
+			typename TH::State state;
+			state.Update(domain);
+
+			std::ifstream input(std::string(path), std::ios::binary);
+
+			if (!input.is_open())
+				return false;
+
+			auto size = std::filesystem::file_size(path);
+			d8u::sse_vector buffer;
+
+			for (uint64_t i = 0; i < size; i += BLOCK)
+			{
+				buffer.resize((size - i < BLOCK) ? size - i : BLOCK);
+				input.read((char*)buffer.data(), buffer.size());
+
+				state.Update(buffer);
+			}
+
+			auto final_hash = state.Finish();
+
+			return std::equal(final_hash.begin(), final_hash.end(), file_hash.begin());
+		}
+
+		//The decoded folder database is spooled to a local file one block at a time and opened mapped.
+		//Resident memory is bounded by the page cache instead of the size of the folder record.
+		//
+		//When a cache folder is given the spool is kept, named by the folder id and checked against the file hash before reuse.
+		//The least recently used databases are evicted once the folder grows past LIMIT.
+		//
+
+		template < typename TH > class Database
+		{
+			std::string path;
+			bool temporary;
+
+			tdb::TinyHashmapSafe db;
+
+			static void evict(std::string_view cache, uint64_t LIMIT, std::string_view keep)
+			{
+				struct Entry
+				{
+					std::vector<std::filesystem::path> files;
+					std::filesystem::file_time_type used;
+					uint64_t size = 0;
+				};
+
+				std::map<std::string, Entry> entries;
+				std::unordered_set<std::string> writing;
+				uint64_t total = 0;
+
+				for (auto& e : std::filesystem::directory_iterator(cache))
+				{
+					if (!e.is_regular_file())
+						continue;
+
+					//Partials <id>.db.<suffix> belong to spools still being written, neither they nor their database are evicted:
+					//
+
+					auto name = e.path().filename().string();
+					auto partial = name.find(".db.");
+
+					if (partial != std::string::npos)
+					{
+						writing.insert(name.substr(0, partial));
+						continue;
+					}
+
+					auto& entry = entries[e.path().stem().string()];
+
+					entry.files.push_back(e.path());
+					entry.size += e.file_size();
+					total += e.file_size();
+
+					if (e.path().extension() == ".db")
+						entry.used = e.last_write_time();
+				}
+
+				std::vector<std::pair<std::filesystem::file_time_type, std::string>> order;
+
+				for (auto& [stem, entry] : entries)
+				{
+					if (stem != std::filesystem::path(keep).stem().string() && !writing.count(stem))
+						order.push_back(std::make_pair(entry.used, stem));
+				}
+
+				std::sort(order.begin(), order.end());
+
+				for (auto& [used, stem] : order)
+				{
+					if (total <= LIMIT)
+						break;
+
+					std::error_code ec;
+					for (auto& f : entries[stem].files)
+						std::filesystem::remove(f, ec);
+
+					total -= entries[stem].size;
+				}
+			}
+
+			//Names of spools being written, thread id hashes repeat across processes sharing a cache.
+			//A random part drawn once per process and a counter keep concurrent writers apart:
+			//
+			static std::string suffix()
+			{
+				static const uint64_t process = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+				static std::atomic<uint64_t> counter = 0;
+
+				return std::to_string(process) + "_" + std::to_string(counter++);
+			}
+
+			template <typename S, typename D> static std::string spool(d8u::util::Statistics& s, const TH& folder_key, S& store, const D& domain, bool validate_blocks, bool hash_file, size_t P, std::string_view cache, uint64_t LIMIT)
+			{
+				auto folder_record = block(s, folder_key, store, domain, validate_blocks);
+
+				if (folder_record.size() % sizeof(TH) != 0)
+					throw std::runtime_error("Malformed Folder Record");
+
+				auto keys = span<TH>((TH*)folder_record.data(), folder_record.size() / sizeof(TH));
+				auto id = d8u::util::to_hex(folder_key.GetNext());
+				auto unique = suffix();
+
+				if (!cache.size())
+				{
+					auto dest = (std::filesystem::temp_directory_path() / ("dircopy_" + id + "_" + unique + ".db")).string();
+
+					try
+					{
+						_file2(s, dest, keys, store, domain, validate_blocks, hash_file, P);
+					}
+					catch (...)
+					{
+						std::error_code ec;
+						std::filesystem::remove(dest, ec);
+						throw;
+					}
+
+					return dest;
+				}
+
+				std::filesystem::create_directories(cache);
+
+				auto dest = (std::filesystem::path(cache) / (id + ".db")).string();
+
+				if (std::filesystem::exists(dest) && file_matches(dest, *(keys.end() - 1), domain))
+				{
+					std::filesystem::last_write_time(dest, std::filesystem::file_time_type::clock::now());
+					return dest;
+				}
+
+				auto partial = dest + "." + unique;
+
+				try
+				{
+					_file2(s, partial, keys, store, domain, validate_blocks, true, P);
+
+					std::error_code ec;
+					std::filesystem::remove(dest, ec);
+					std::filesystem::rename(partial, dest);
+				}
+				catch (...)
+				{
+					std::error_code ec;
+					std::filesystem::remove(partial, ec);
+					throw;
+				}
 
-			auto database = restore::file_memory(s, gsl::span<TH>((TH*)folder_record.data(), folder_record.size() / sizeof(TH)), store, domain, validate_blocks, hash_file);
+				evict(cache, LIMIT, dest);
 
-			typename tdb::MemoryHashmap db(database);
+				return dest;
+			}
 
+		public:
+			template <typename S, typename D> Database(d8u::util::Statistics& s, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1, std::string_view cache = "", uint64_t LIMIT = 4ull * 1024 * 1024 * 1024)
+				: path(spool(s, folder_key, store, domain, validate_blocks, hash_file, P, cache, LIMIT))
+				, temporary(!cache.size())
+				, db(path) { }
+
+			~Database()
+			{
+				db.Close();
+
+				std::error_code ec;
+				if (temporary)
+					std::filesystem::remove(path, ec);
+			}
+
+			std::string Path() { return path; }
+
+			bool Cached() { return !temporary; }
+
+			template < typename F > size_t Iterate(F&& f)
+			{
+				return (size_t)db.Iterate(f);
+			}
+
+			//Records that died in a later generation keep their key, they are renamed and no longer match:
+			//
+			auto Find(std::string_view name)
+			{
+				auto p = db.Find(name);
+
+				if (p && std::get<2>(delta::Path<TH>::Decode(db, db.GetObject(*p))) != name)
+					return decltype(p)(nullptr);
+
+				return p;
+			}
+
+			uint8_t* GetObject(uint64_t p)
+			{
+				return db.GetObject(p);
+			}
+
+			template < typename K > uint8_t* FindObject(const K& k)
+			{
+				return db.FindObject(k);
+			}
+
+			auto Record(uint64_t p)
+			{
+				return delta::Path<TH>::Decode(db, db.GetObject(p));
+			}
+
+			template < typename D > auto Statistics(const D& domain)
 			{
 				auto [size, time, name, data] = delta::Path<TH>::DecodeRaw(db.FindObject(domain));
 
-				auto stats = (typename delta::Path<TH>::FolderStatistics * )data.data();
+				return *(typename delta::Path<TH>::FolderStatistics*)data.data();
+			}
+		};
+
+		//Restore destination, folders that were already created are remembered:
+		//
+		class FolderSink
+		{
+			std::string root;
+
+			std::mutex lock;
+			std::unordered_set<std::string> folders;
+
+			std::string prepare(std::string_view name)
+			{
+				auto path = root + "\\" + std::string(name);
+				auto folder = std::filesystem::path(path).parent_path().string();
+
+				std::lock_guard<std::mutex> guard(lock);
+
+				if (folders.insert(folder).second)
+					std::filesystem::create_directories(folder);
 
-				s.direct.target = stats->size;
+				return path;
 			}
 
+		public:
+			FolderSink(std::string_view _root)
+				: root(_root) { }
+
+			void Empty(std::string_view name)
+			{
+				d8u::util::empty_file(prepare(name));
+			}
+
+			std::ofstream Open(std::string_view name)
+			{
+				std::ofstream output(prepare(name), std::ios::binary);
+
+				if (!output.is_open())
+					throw std::runtime_error("Failed to create file");
+
+				return output;
+			}
+		};
+
+		//Staged restore for many small files:
+		//Metadata -> Fetch ( F ) -> Decode ( P ) -> Write ( F )
+		//Files with more than SMALL blocks are streamed from the fetch stage instead of being held in memory.
+		//Fetches are not batched, the store's bulk query ( _Many1 / _Many2 ) only answers which blocks exist. Each block is one Read, F fetch threads keep several in flight.
+		//
+
+		template <typename TH, typename DB, typename SINK, typename S, typename D> void stream_folder(Statistics& s, DB& db, SINK& sink, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t P = 1, size_t F = 1, size_t SMALL = 16)
+		{
+			struct File
+			{
+				File() {}
+
+				File(std::string_view _name, uint64_t _size, span<TH> _keys)
+					: name(_name)
+					, size(_size)
+					, keys(_keys.begin(), _keys.end()) {}
+
+				std::string name;
+				uint64_t size;
+
+				std::vector<TH> keys;
+				std::vector<d8u::sse_vector> blocks;
+			};
+
+			constexpr size_t look_ahead = 4096;
+
+			std::atomic<bool> failed = false;
+			std::string error;
+			std::mutex error_lock;
+
+			auto fail = [&](const char* message)
+			{
+				std::lock_guard<std::mutex> guard(error_lock);
+
+				if (!failed)
+					error = message;
+
+				failed = true;
+				s.atomic.files--;
+			};
+
+			{
+				d8u::async::Pipeline<File, 5> file_pipeline;
+
+				file_pipeline.Start([&](auto& prev, auto& next)
+				{
+					db.Iterate([&](uint64_t p)
+					{
+						auto [size, time, name, keys] = db.Record(p);
+
+						if (!size)
+						{
+							if (delta::Path<TH>::Internal(name))
+								return true; //Stats block
+
+							sink.Empty(name);
+							return true;
+						}
+
+						s.atomic.files++;
+
+						next.Push(File(name, size, keys), look_ahead);
+
+						return !failed.load();
+					});
+				});
+
+				file_pipeline.Stream([&](auto&& file, auto& next)
+				{
+					try
+					{
+						if (file.keys.size() == 1)
+						{
+							auto list = block(s, file.keys[0], store, domain, validate_blocks);
+
+							if (list.size() % sizeof(TH) != 0)
+								throw std::runtime_error("Malformed File Record");
+
+							file.keys.assign((TH*)list.data(), (TH*)list.data() + list.size() / sizeof(TH));
+						}
+
+						if (file.keys.size() <= 1)
+							throw std::runtime_error("Malformed Folder Record ( 2 )");
+
+						if (file.keys.size() - 1 > SMALL || tree::Is(span<TH>(file.keys.data(), file.keys.size())))
+						{
+							auto output = sink.Open(file.name);
+
+							_stream(s, output, span<TH>(file.keys.data(), file.keys.size()), store, domain, validate_blocks, hash_file, P);
+
+							s.atomic.files--;
+							return true;
+						}
+
+						file.blocks.resize(file.keys.size() - 1 /*Last hash is the file hash*/);
+
+						for (size_t i = 0; i < file.blocks.size(); i++)
+						{
+							file.blocks[i] = store.Read(file.keys[i].GetNext());
+
+							s.atomic.blocks++;
+							s.atomic.read += file.blocks[i].size();
+						}
+
+						next.Push(std::move(file), look_ahead);
+					}
+					catch (const std::exception& ex)
+					{
+						fail(ex.what());
+					}
+
+					return true;
+				}, F);
+
+				file_pipeline.Stream([&](auto&& file, auto& next)
+				{
+					try
+					{
+						for (size_t i = 0; i < file.blocks.size(); i++)
+						{
+							auto key = file.keys[i];
+
+							decode(domain, file.blocks[i], key);
+
+							if (validate_blocks)
+							{
+								TH dup_key(domain, file.blocks[i]);
+
+								if (!std::equal(key.begin(), key.end(), dup_key.begin()))
+									throw std::runtime_error("Corrupt Block");
+							}
+						}
+
+						next.Push(std::move(file), look_ahead);
+					}
+					catch (const std::exception& ex)
+					{
+						fail(ex.what());
+					}
+
+					return true;
+				}, P);
+
+				file_pipeline.Stream([&](auto&& file, auto& next)
+				{
+					try
+					{
+						typename TH::State state;
+
+						if (hash_file)
+							state.Update(domain);
+
+						auto output = sink.Open(file.name);
+
+						for (auto& b : file.blocks)
+						{
+							if (hash_file)
+								state.Update(b);
+
+							s.atomic.write += b.size();
+
+							output.write((char*)b.data(), b.size());
+						}
+
+						if (hash_file)
+						{
+							auto final_hash = state.Finish();
+
+							if (!std::equal(final_hash.begin(), final_hash.end(), file.keys.back().begin()))
+								throw std::runtime_error("Corrupt File");
+						}
+
+						s.atomic.files--;
+					}
+					catch (const std::exception& ex)
+					{
+						fail(ex.what());
+					}
+
+					return true;
+				}, F);
+			}
+
+			if (failed)
+				throw std::runtime_error(error);
+		}
+
+		template <typename TH, typename S, typename D> void folder2(Statistics & s,std::string_view dest, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			Database<TH> db(s, folder_key, store, domain, validate_blocks, hash_file, P, cache, CACHE);
+
+			s.direct.target = db.Statistics(domain).size;
+
 			auto file = [&](uint64_t p)
 			{
 				dec_scope lock(s.atomic.files);
 
-				auto [size, time, name, keys] = delta::Path<TH>::Decode(db.GetObject(p));
+				auto [size, time, name, keys] = db.Record(p);
 
 				if (!size)
 				{
-					if (name.size() > 3 && name[0] == '|' && name[1] == '|' && name[2] == '|')
+					if (delta::Path<TH>::Internal(name))
 						return true; //Stats block
 
 					d8u::util::empty_file(std::string(dest) + "\\" + string(name));
@@ -226,18 +766,9 @@ namespace dircopy
 				});
 			else
 			{
-				db.Iterate([&](uint64_t p)
-				{
-					fast_wait(s.atomic.files,F);
-
-					s.atomic.files++;
-
-					std::thread(file, p).detach();
-
-					return true;
-				});
+				FolderSink sink(dest);
 
-				fast_wait(s.atomic.files);
+				stream_folder<TH>(s, db, sink, store, domain, validate_blocks, hash_file, P, F);
 			}
 		}
 
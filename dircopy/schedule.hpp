@@ -0,0 +1,484 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <type_traits>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <exception>
+
+#include "d8u/transform.hpp"
+#include "d8u/util.hpp"
+
+#include "tdb/legacy.hpp"
+
+#include "defs.hpp"
+#include "delta.hpp"
+#include "restore.hpp"
+
+namespace dircopy
+{
+	namespace schedule
+	{
+		using namespace defs;
+		using namespace d8u::util;
+		using namespace d8u::transform;
+
+		//Stores that know where a block physically lives expose uint64_t Locate(id).
+		//Stores that don't are scheduled in reference order, duplicates are still fetched once.
+		//
+
+		template < typename S, typename TH, typename = void > struct has_locate : std::false_type {};
+
+		template < typename S, typename TH > struct has_locate<S, TH, std::void_t<decltype(std::declval<S&>().Locate(std::declval<const TH&>()))>> : std::true_type {};
+
+		struct Profile
+		{
+			uint64_t references = 0;
+			uint64_t unique = 0;
+			uint64_t seeks = 0;
+			uint64_t distance = 0;
+
+			bool located = false;
+		};
+
+		template < typename TH > class Plan
+		{
+		public:
+			struct Target
+			{
+				std::string name;
+				uint64_t size;
+				TH hash;
+			};
+
+			struct Reference
+			{
+				TH key;
+				uint64_t location;
+				uint64_t offset;
+				uint32_t file;
+			};
+
+		private:
+
+			std::vector<Target> files;
+			std::vector<Reference> blocks;
+
+			size_t BLOCK;
+			bool located = false;
+
+		public:
+			Plan(size_t _BLOCK = 1024 * 1024)
+				: BLOCK(_BLOCK) { }
+
+			size_t Files() { return files.size(); }
+			size_t Blocks() { return blocks.size(); }
+
+			const std::vector<Target>& Targets() { return files; }
+
+			void Clear()
+			{
+				files.clear();
+				blocks.clear();
+				located = false;
+			}
+
+			//keys is the complete key list of a file, the last hash is the file hash.
+			//
+			void File(std::string_view name, uint64_t size, span<TH> keys)
+			{
+				if (keys.size() < 2)
+					throw std::runtime_error("Malformed Key List");
+
+				auto file = (uint32_t)files.size();
+				files.push_back(Target{ std::string(name), size, *(keys.end() - 1) });
+
+				for (size_t i = 0; i < keys.size() - 1 /*Last hash is the file hash*/; i++)
+					blocks.push_back(Reference{ keys[i], blocks.size(), i * BLOCK, file });
+			}
+
+			template < typename S > void Locate(S& store)
+			{
+				if constexpr (has_locate<S, TH>::value)
+				{
+					for (auto& b : blocks)
+						b.location = store.Locate(b.key.GetNext());
+
+					located = true;
+				}
+			}
+
+			//Unique is only exact after Sort, duplicates are adjacent then.
+			//
+			Profile Measure()
+			{
+				Profile p;
+
+				p.located = located;
+				p.references = blocks.size();
+
+				if (!blocks.size())
+					return p;
+
+				for (size_t i = 0; i < blocks.size(); i++)
+				{
+					if (i == 0 || !std::equal(blocks[i].key.begin(), blocks[i].key.end(), blocks[i - 1].key.begin()))
+						p.unique++;
+				}
+
+				uint64_t last = blocks.front().location;
+
+				for (auto& b : blocks)
+				{
+					//A stored block is never larger than BLOCK, anything further away than one block is a seek.
+					//
+
+					auto delta = (b.location >= last) ? b.location - last : last - b.location;
+
+					if (b.location < last || delta > BLOCK)
+					{
+						p.seeks++;
+						p.distance += delta;
+					}
+
+					last = b.location;
+				}
+
+				return p;
+			}
+
+			//Locality order, references to the same block are adjacent so it is fetched once:
+			//
+			void Sort()
+			{
+				std::stable_sort(blocks.begin(), blocks.end(), [](const auto& l, const auto& r)
+				{
+					if (l.location != r.location)
+						return l.location < r.location;
+
+					return l.file < r.file;
+				});
+
+				if (located)
+					return;
+
+				//Without locations the first reference decides the order of every duplicate:
+				//
+
+				std::vector<size_t> order(blocks.size());
+				for (size_t i = 0; i < order.size(); i++)
+					order[i] = i;
+
+				std::stable_sort(order.begin(), order.end(), [&](auto l, auto r)
+				{
+					return std::lexicographical_compare(blocks[l].key.begin(), blocks[l].key.end(), blocks[r].key.begin(), blocks[r].key.end());
+				});
+
+				for (size_t i = 1; i < order.size(); i++)
+				{
+					auto& cur = blocks[order[i]];
+					auto& prev = blocks[order[i - 1]];
+
+					if (std::equal(cur.key.begin(), cur.key.end(), prev.key.begin()))
+						cur.location = prev.location;
+				}
+
+				std::stable_sort(blocks.begin(), blocks.end(), [](const auto& l, const auto& r) { return l.location < r.location; });
+			}
+
+			//Calls f(key, references) once per unique block, P groups in flight.
+			//The first exception f throws stops the other workers and is rethrown once they are joined:
+			//
+			template < typename F > void Run(F&& f, size_t P = 1)
+			{
+				std::vector<std::pair<size_t, size_t>> groups;
+
+				for (size_t i = 0, s = 0; i <= blocks.size(); i++)
+				{
+					if (i == blocks.size() || !std::equal(blocks[i].key.begin(), blocks[i].key.end(), blocks[s].key.begin()))
+					{
+						if (i != s)
+							groups.push_back(std::make_pair(s, i - s));
+
+						s = i;
+					}
+				}
+
+				std::atomic<size_t> next = 0;
+				std::atomic<bool> failed = false;
+				std::exception_ptr error;
+				std::mutex error_lock;
+
+				auto worker = [&]()
+				{
+					try
+					{
+						for (size_t g = next++; !failed && g < groups.size(); g = next++)
+							f(blocks[groups[g].first].key, span<Reference>(blocks.data() + groups[g].first, groups[g].second));
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> guard(error_lock);
+
+						if (!error)
+							error = std::current_exception();
+
+						failed = true;
+					}
+				};
+
+				if (P <= 1)
+					worker();
+				else
+				{
+					std::vector<std::thread> pool;
+
+					for (size_t i = 0; i < P; i++)
+						pool.emplace_back(worker);
+
+					for (auto& t : pool)
+						t.join();
+				}
+
+				if (error)
+					std::rethrow_exception(error);
+			}
+		};
+
+		//Collects the plan for every file in the folder database, WINDOW limits how many block references are held at once.
+		//f(plan) is called for each window.
+		//
+		template < typename TH, typename DB, typename S, typename D, typename F > void windows(Statistics& s, DB& db, S& store, const D& domain, bool validate_blocks, size_t BLOCK, size_t WINDOW, F&& f)
+		{
+			Plan<TH> plan(BLOCK);
+
+			auto flush = [&]()
+			{
+				if (!plan.Files())
+					return;
+
+				plan.Locate(store);
+				f(plan);
+				plan.Clear();
+			};
+
+			db.Iterate([&](uint64_t p)
+			{
+				auto [size, time, name, keys] = db.Record(p);
+
+				if (!size)
+					return true;
+
+				if (keys.size() == 1)
+				{
+					auto list = restore::list(s, *keys.data(), store, domain, validate_blocks);
+
+					plan.File(name, size, span<TH>((TH*)list.data(), list.size() / sizeof(TH)));
+				}
+				else
+					plan.File(name, size, keys);
+
+				if (plan.Blocks() >= WINDOW)
+					flush();
+
+				return true;
+			});
+
+			flush();
+		}
+
+		void print(const Profile& naive, const Profile& planned)
+		{
+			std::cout << "References " << planned.references << ", Unique " << planned.unique << std::endl;
+
+			if (!planned.located)
+			{
+				std::cout << "Store does not expose block locations, fetches are ordered by first reference." << std::endl;
+				return;
+			}
+
+			std::cout << "Reference order: Seeks " << naive.seeks << ", Distance " << naive.distance << std::endl;
+			std::cout << "Locality order: Seeks " << planned.seeks << ", Distance " << planned.distance << std::endl;
+		}
+
+		template < typename TH, typename S, typename D > Profile profile(Statistics& s, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, size_t BLOCK = 1024 * 1024, size_t WINDOW = 64 * 1024, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			restore::Database<TH> db(s, folder_key, store, domain, validate_blocks, validate_blocks, 1, cache, CACHE);
+
+			Profile naive, planned;
+
+			windows<TH>(s, db, store, domain, validate_blocks, BLOCK, WINDOW, [&](auto& plan)
+			{
+				auto before = plan.Measure();
+				plan.Sort();
+				auto after = plan.Measure();
+
+				naive.references += before.references;
+				naive.unique += before.unique;
+				naive.seeks += before.seeks;
+				naive.distance += before.distance;
+				naive.located = before.located;
+
+				planned.references += after.references;
+				planned.unique += after.unique;
+				planned.seeks += after.seeks;
+				planned.distance += after.distance;
+				planned.located = after.located;
+			});
+
+			//Unique blocks are counted per window, report what would actually be fetched:
+			//
+
+			naive.unique = planned.unique;
+
+			print(naive, planned);
+
+			return planned;
+		}
+
+		//Consecutive references mostly land in the same few files, each writer keeps the last LIMIT of them open:
+		//
+		class Handles
+		{
+			std::list<std::pair<size_t, std::fstream>> open;
+			size_t limit;
+
+		public:
+			Handles(size_t LIMIT = 8)
+				: limit(LIMIT) {}
+
+			template < typename F > std::fstream& Get(size_t file, F&& path)
+			{
+				for (auto it = open.begin(); it != open.end(); ++it)
+				{
+					if (it->first == file)
+					{
+						open.splice(open.begin(), open, it);
+						return open.front().second;
+					}
+				}
+
+				if (open.size() >= limit)
+					open.pop_back();
+
+				open.emplace_front(file, std::fstream(path(), std::ios::binary | std::ios::in | std::ios::out));
+
+				if (!open.front().second.is_open())
+				{
+					open.pop_front();
+					throw std::runtime_error("Failed to open file");
+				}
+
+				return open.front().second;
+			}
+		};
+
+		//Creates every target of the plan under dest and fills it in locality order, writes are scattered to their file offsets:
+		//
+		template <typename TH, typename S, typename D> void write(Statistics& s, std::string_view dest, Plan<TH>& plan, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t BLOCK = 1024 * 1024, size_t P = 1)
+		{
+			for (auto& t : plan.Targets())
+			{
+				auto path = std::string(dest) + "\\" + t.name;
+
+				std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+
+				{
+					std::ofstream output(path, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create file");
+				}
+
+				std::filesystem::resize_file(path, t.size);
+			}
+
+			plan.Sort();
+
+			std::mutex lock;
+			std::map<std::thread::id, Handles> handles;
+
+			plan.Run([&](const TH& key, auto references)
+			{
+				auto buffer = restore::block(s, key, store, domain, validate_blocks);
+
+				Handles* local;
+
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					local = &handles[std::this_thread::get_id()];
+				}
+
+				for (auto& r : references)
+				{
+					auto& output = local->Get(r.file, [&]() { return std::string(dest) + "\\" + plan.Targets()[r.file].name; });
+
+					output.seekp(r.offset);
+					output.write((char*)buffer.data(), buffer.size());
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write file");
+
+					s.atomic.write += buffer.size();
+				}
+			}, P);
+
+			handles.clear();
+
+			if (!hash_file)
+				return;
+
+			//Blocks arrived out of order, the file hash is checked against what landed on disk:
+			//
+
+			for (auto& t : plan.Targets())
+			{
+				if (!restore::file_matches(std::string(dest) + "\\" + t.name, t.hash, domain, BLOCK))
+					throw std::runtime_error("Corrupt File");
+			}
+		}
+
+		//Restore a folder fetching blocks in store locality order, writes are scattered to their file offsets:
+		//
+		template <typename TH, typename S, typename D> void folder2(Statistics& s, std::string_view dest, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t BLOCK = 1024 * 1024, size_t P = 1, size_t WINDOW = 64 * 1024, std::string_view cache = "", uint64_t CACHE = 4ull * 1024 * 1024 * 1024)
+		{
+			restore::Database<TH> db(s, folder_key, store, domain, validate_blocks, hash_file, P, cache, CACHE);
+
+			s.direct.target = db.Statistics(domain).size;
+
+			db.Iterate([&](uint64_t p)
+			{
+				auto [size, time, name, keys] = db.Record(p);
+
+				if (!size && !delta::Path<TH>::Internal(name))
+					d8u::util::empty_file(std::string(dest) + "\\" + string(name));
+
+				return true;
+			});
+
+			windows<TH>(s, db, store, domain, validate_blocks, BLOCK, WINDOW, [&](auto& plan)
+			{
+				write(s, dest, plan, store, domain, validate_blocks, hash_file, BLOCK, P);
+			});
+		}
+
+		template <typename TH, typename S, typename D> Direct folder(std::string_view dest, const TH& folder_key, S& store, const D& domain, bool validate_blocks = false, bool hash_file = false, size_t BLOCK = 1024 * 1024, size_t P = 1, size_t WINDOW = 64 * 1024)
+		{
+			Statistics s;
+
+			folder2(s, dest, folder_key, store, domain, validate_blocks, hash_file, BLOCK, P, WINDOW);
+
+			return s.direct;
+		}
+	}
+}
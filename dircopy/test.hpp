@@ -9,6 +9,10 @@
 #include "restore.hpp"
 #include "validate.hpp"
 #include "mount.hpp"
+#include "diff.hpp"
+#include "analyze.hpp"
+#include "mark.hpp"
+#include "tree.hpp"
 
 #include "volstore/simple.hpp"
 #include "volstore/image.hpp"
@@ -179,9 +183,110 @@ TEST_CASE("Folder", "[dircopy::backup/restore]")
 
 	CHECK(std::equal(result1.key.begin(), result1.key.end(), result2.key.begin()));
 	CHECK(result3.stats.duplicate == result1.stats.read);
+	CHECK(std::filesystem::exists("delta/waste.db")); //result2 started from result1's generation
+
+	{
+		delta::Lock running;
+
+		CHECK(running.Acquire("delta/lock.db"));
+		CHECK(!delta::Path<>::Stale("delta"));
+		CHECK_THROWS(delta::Path<>("delta", ""));
+	}
+
+	CHECK(delta::Path<>::Stale("delta")); //Nobody holds it and there is no checkpoint
+	std::filesystem::remove("delta/lock.db");
 
 	CHECK(validate::folder(result2.key, store, util::default_domain, 1024 * 1024, 64 * 1024 * 1024, 4, 4).first);
 	CHECK(validate::deep_folder(result2.key, store, util::default_domain, 1024 * 1024, 64 * 1024 * 1024, 4, 4).first);
+	CHECK(validate::batch_folder(result2.key, store, util::default_domain, 4, 8).first);
+	CHECK(validate::stream_folder(result2.key, store, util::default_domain, 4, 4).first);
+
+	{
+		util::Statistics rebuilt;
+
+		std::filesystem::remove_all("rebuiltdelta");
+		std::filesystem::create_directories("rebuiltdelta");
+
+		CHECK(backup::rebuild_state2("rebuiltdelta", rebuilt, result1.key, store, util::default_domain, "testdata") > 0);
+
+		auto result4 = backup::recursive_folder("", "rebuiltdelta", "testdata", store,
+			[](auto&, auto, auto) { return true; }, util::default_domain, 5, 1024 * 1024, 8, 5, 8, 64 * 1024 * 1024);
+
+		CHECK(std::equal(result1.key.begin(), result1.key.end(), result4.key.begin()));
+
+		std::filesystem::remove_all("rebuiltdelta");
+	}
+
+	{
+		util::Statistics d;
+
+		auto summary = diff::core_diff(d, result1.key, result2.key, store, util::default_domain, [](auto change, auto name, auto before, auto after, auto blocks) { return true; });
+
+		CHECK(0 == summary.added + summary.removed + summary.modified);
+		CHECK(summary.unchanged > 0);
+	}
+
+	{
+		util::Statistics many;
+
+		CHECK(validate::many2(many, std::vector{ result1.key, result2.key, result3.key }, store, util::default_domain, true, [](auto, auto) {}, 4));
+		CHECK(many.direct.dblocks > 0);
+	}
+
+	{
+		util::Statistics churn;
+
+		auto snapshots = analyze::core_churn(churn, std::vector{ result1.key, result2.key }, store, util::default_domain, [](auto, auto&) {});
+
+		CHECK(snapshots[0].new_bytes == snapshots[0].unique_bytes);
+		CHECK(snapshots[1].new_bytes == 0);
+		CHECK(snapshots[1].shared_bytes == snapshots[1].unique_bytes);
+	}
+
+	{
+		util::Statistics marking;
+
+		auto [ok, marked] = mark::mark2(marking, std::vector{ result1.key, result2.key }, store, util::default_domain, "live.mark", 4, 4096);
+
+		CHECK(ok);
+		CHECK(marked.live > 0);
+		CHECK(marked.live <= marked.referenced);
+
+		{
+			mark::Live<decltype(result1.key)> live("live.mark");
+
+			CHECK(live.Size() == marked.live);
+			CHECK(live.Contains(result2.key.GetNext()));
+		}
+
+		std::filesystem::remove("live.mark");
+	}
+
+	{
+		util::Statistics sampled;
+
+		auto [ok, estimate] = validate::sample_folder2(sampled, result2.key, store, util::default_domain, 64, 0.95, validate::Strata::size, 1, 4);
+
+		CHECK(ok);
+		CHECK(estimate.total.sampled > 0);
+		CHECK(estimate.total.sampled <= estimate.total.population);
+		CHECK(estimate.total.upper < 1);
+	}
+
+	{
+		std::filesystem::remove("ledger.db");
+
+		util::Statistics first, second;
+
+		CHECK(validate::folder2(first, result2.key, store, util::default_domain, 1024 * 1024, 64 * 1024 * 1024, 4, 4, "ledger.db", 60 * 60));
+		CHECK(validate::folder2(second, result2.key, store, util::default_domain, 1024 * 1024, 64 * 1024 * 1024, 4, 4, "ledger.db", 60 * 60));
+
+		CHECK(first.direct.items == 0);
+		CHECK(second.direct.items > 0);
+		CHECK(second.direct.blocks < first.direct.blocks);
+
+		std::filesystem::remove("ledger.db");
+	}
 
 	restore::folder("restore1", result1.key, store, util::default_domain, true, true, 1024 * 1024, 64 * 1024 * 1024, 8, 8);
 	CHECK(compare::folders("testdata", "restore1", 8));
@@ -230,11 +335,151 @@ TEST_CASE("Exclusion", "[dircopy::backup]")
 
 	CHECK(1024 * 1024 /*Database Block*/ == result.stats.read);
 
+	{
+		exclude::Rules rules;
+
+		rules.File("\\empty");
+		rules.Path("\\testpath");
+		rules.Glob("*.TMP");
+		rules.Glob("\\cache?\\*.bin");
+
+		CHECK(rules.Excluded("\\empty"));
+		CHECK(!rules.Excluded("\\empty2"));
+		CHECK(rules.Excluded("\\testpath\\a\\b"));
+		CHECK(rules.Excluded("\\a\\b.tmp"));
+		CHECK(rules.Excluded("\\cache1\\x.bin"));
+		CHECK(!rules.Excluded("\\cache12\\x.bin"));
+		CHECK(!rules.Excluded("\\a\\b.tmpx"));
+
+		CHECK(rules.Pruned("\\testpath"));
+		CHECK(!rules.Pruned("\\a"));
+	}
+
 	std::filesystem::remove_all("teststore");
 	std::filesystem::remove_all("delta");
 }
 
 
+TEST_CASE("Record formats", "[dircopy::backup]")
+{
+	using P = delta::Path<>;
+
+	std::string_view name = "\\dir\\file";
+	std::vector<uint8_t> record(24 + name.size() + 64);
+
+	*(uint32_t*)record.data() = (uint32_t)record.size();
+	*(uint64_t*)(record.data() + 4) = 12345;
+	*(uint64_t*)(record.data() + 12) = 678;
+	*(uint16_t*)(record.data() + 20) = (uint16_t)name.size();
+	std::copy(name.begin(), name.end(), record.data() + 22);
+	*(uint16_t*)(record.data() + 22 + name.size()) = 64;
+
+	auto [size, time, _name, keys] = P::Decode(record.data());
+
+	CHECK(size == 12345);
+	CHECK(time == 678);
+	CHECK(_name == name);
+	CHECK(keys.size() == 2);
+	CHECK(P::Extent(record.data()) == record.size());
+
+	std::vector<uint8_t> compact = { 0, 0, 0, 0x80, 0xb9, 0x60, 0xa6, 0x05, 0x01, 'a', 0x20 };
+	compact.resize(compact.size() + 32);
+	*(uint32_t*)compact.data() |= (uint32_t)compact.size();
+
+	auto [csize, ctime, cname, ckeys] = P::Decode(compact.data());
+
+	CHECK(csize == 12345);
+	CHECK(ctime == 678);
+	CHECK(cname == "a");
+	CHECK(ckeys.size() == 1);
+	CHECK(P::Extent(compact.data()) == compact.size());
+
+	uint64_t large = 5ull << 30;
+	*(uint64_t*)(record.data() + 4) = (uint32_t)large;
+
+	std::vector<uint8_t> queued(128);
+	*(uint32_t*)queued.data() = P::COMPACT | (uint32_t)queued.size();
+
+	CHECK(!P::Reuse(record.data(), queued.data(), name, 6ull << 30, 678));
+	CHECK(P::Reuse(record.data(), queued.data(), name, large, 678));
+
+	auto [qsize, qtime, qname, qkeys] = P::Decode(queued.data());
+
+	CHECK(qsize == large);
+	CHECK(qtime == 678);
+	CHECK(qname == name);
+	CHECK(qkeys.size() == 2);
+
+	struct DB
+	{
+		std::vector<uint8_t> bytes = { 0, 0, 0, 0, 0, 0, 0, 4, '\\', 'd', 'i', 'r', 0 };
+
+		uint8_t* GetObject(uint64_t p) { return bytes.data() + p; }
+	} db;
+
+	*(uint32_t*)db.bytes.data() = P::COMPACT | P::PARENT | P::FOLDER | (uint32_t)db.bytes.size();
+
+	std::vector<uint8_t> child = { 0, 0, 0, 0, 0, 0, 1, 0, 0 };
+	child.resize(128);
+	*(uint32_t*)child.data() = P::COMPACT | P::PARENT | (uint32_t)child.size();
+
+	CHECK(P::Reuse(record.data(), child.data(), name, large, 678));
+
+	auto [fsize, ftime, fname, fkeys] = P::Decode(db, child.data());
+
+	CHECK(fsize == large);
+	CHECK(fname == name);
+	CHECK(std::get<2>(P::Decode(child.data())) == "\\file");
+	CHECK(fkeys.size() == 2);
+	CHECK(P::Internal(P::Name(db, db.bytes.data())));
+}
+
+TEST_CASE("Key tree", "[dircopy::backup]")
+{
+	struct Key { uint8_t bytes[32]; };
+
+	for (uint64_t count : { 3, 8, 65, 200 })
+	{
+		d8u::sse_vector list;
+		list.resize((count + 1) * sizeof(Key));
+		std::fill(list.data(), list.data() + list.size(), (uint8_t)0);
+
+		for (uint64_t i = 0; i <= count; i++)
+			std::memcpy(list.data() + i * sizeof(Key), &i, sizeof(i));
+
+		std::vector<d8u::sse_vector> nodes;
+
+		auto built = tree::Build<Key>(list, [&](auto& node)
+		{
+			Key key = {};
+			uint64_t id = nodes.size();
+
+			nodes.push_back(node);
+			std::memcpy(key.bytes, &id, sizeof(id));
+
+			return key;
+		}, 4);
+
+		auto root = gsl::span<Key>((Key*)list.data(), list.size() / sizeof(Key));
+
+		CHECK(built == (count > 4));
+		CHECK(built == tree::Is(root));
+
+		if (!built)
+			continue;
+
+		CHECK(tree::Read(root).blocks == count);
+		CHECK(*(uint64_t*)(root.end() - 1)->bytes == count); //File hash stays last
+
+		for (uint64_t i = 0; i < count; i++)
+		{
+			auto key = tree::Locate(root, i, [&](const Key& k) { return std::make_shared<const d8u::sse_vector>(nodes[*(uint64_t*)k.bytes]); });
+
+			CHECK(*(uint64_t*)key.bytes == i);
+		}
+	}
+}
+
 TEST_CASE("Mount", "[dircopy::backup/restore]")
 {
 	std::filesystem::remove_all("mount");
@@ -254,6 +499,7 @@ TEST_CASE("Mount", "[dircopy::backup/restore]")
 	CHECK(3 == handle.Search("tiny", [](auto s, auto t, auto n, auto k) {return true; }));
 	CHECK(6 == handle.Search("compress", [](auto s, auto t, auto n, auto k) {return true; }));
 	CHECK(2 == handle.Search("nocompress", [](auto s, auto t, auto n, auto k) {return true; }));
+	CHECK(4 == handle.Search(std::vector<std::string>{ "TINY", "medium" }, [](auto i, auto s, auto t, auto n, auto k) {return true; }));
 
 	size_t count = 0;
 
@@ -263,7 +509,38 @@ TEST_CASE("Mount", "[dircopy::backup/restore]")
 		return true;
 	});
 
-	CHECK(8 + 1 /*Stats*/ == count);
+	CHECK(8 == count);
+
+	size_t listed = 0;
+	uint64_t total = 0;
+
+	CHECK(handle.List("", [&](auto n, auto d, auto s, auto t)
+	{
+		listed++;
+		total += s;
+		return true;
+	}));
+
+	CHECK(listed > 0);
+	CHECK(total > 0);
+
+	std::string large;
+	handle.Search("large_compress", [&](auto s, auto t, auto n, auto k) { large = std::string(n); return true; });
+
+	{
+		auto range = handle.Read(large, 1024 * 1024 - 16, 4096);
+
+		std::vector<uint8_t> expected(range.size());
+		std::ifstream input("testdata" + large, std::ios::binary);
+		input.seekg(1024 * 1024 - 16);
+		input.read((char*)expected.data(), expected.size());
+
+		CHECK(4096 == range.size());
+		CHECK(expected == range);
+	}
+
+	CHECK(6 == handle.Fetch(std::vector<std::string>{ "*compress*", large }, "mount", 4));
+	CHECK(std::filesystem::file_size("mount\\" + large) == std::filesystem::file_size("testdata" + large));
 
 	std::filesystem::remove_all("mount");
 	std::filesystem::remove_all("delta");
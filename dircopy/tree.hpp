@@ -0,0 +1,154 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include "d8u/memory.hpp"
+#include "../gsl-lite.hpp"
+
+namespace dircopy
+{
+	namespace tree
+	{
+		//Key trees:
+		//A large file is stored with one key pointing to its key list. Past FANOUT blocks the list becomes a tree of bounded nodes, each a block of its own.
+		//Nodes are keys too: MAGIC, a header, then the children. Level 0 children are data blocks, above that they are nodes covering stride data blocks each.
+		//The root ends with the file hash like a flat list does. Lists of FANOUT blocks or fewer stay flat and are read as before.
+		//
+
+		static constexpr std::string_view MAGIC = "|||Key Tree|||";
+
+		static constexpr size_t FANOUT = 4096;
+
+		struct Header
+		{
+			uint64_t level;
+			uint64_t blocks;
+			uint64_t stride;
+			uint64_t root;
+		};
+
+		template < typename TH > bool Is(gsl::span<TH> list)
+		{
+			static_assert(sizeof(Header) <= sizeof(TH));
+
+			if (list.size() < 3)
+				return false;
+
+			uint8_t slot[sizeof(TH)] = {};
+			std::copy(MAGIC.begin(), MAGIC.end(), slot);
+
+			return std::equal(slot, slot + sizeof(TH), (const uint8_t*)list.data());
+		}
+
+		template < typename TH > Header Read(gsl::span<TH> node)
+		{
+			Header header;
+			std::copy((const uint8_t*)(node.data() + 1), (const uint8_t*)(node.data() + 1) + sizeof(Header), (uint8_t*)&header);
+
+			return header;
+		}
+
+		//Keys below one list, a flat list without its file hash:
+		//
+		template < typename TH > gsl::span<TH> Children(gsl::span<TH> list)
+		{
+			if (!Is(list))
+				return list.first(list.size() - 1);
+
+			return list.subspan(2, list.size() - 2 - (Read(list).root ? 1 : 0));
+		}
+
+		template < typename TH > d8u::sse_vector Node(const Header& header, const TH* children, size_t count, const TH* hash)
+		{
+			d8u::sse_vector node;
+			node.resize((2 + count + (hash ? 1 : 0)) * sizeof(TH));
+
+			std::fill(node.data(), node.data() + node.size(), (uint8_t)0);
+			std::copy(MAGIC.begin(), MAGIC.end(), node.data());
+			std::copy((const uint8_t*)&header, (const uint8_t*)&header + sizeof(Header), node.data() + sizeof(TH));
+			std::copy((const uint8_t*)children, (const uint8_t*)(children + count), node.data() + 2 * sizeof(TH));
+
+			if (hash)
+				std::copy((const uint8_t*)hash, (const uint8_t*)(hash + 1), node.data() + (2 + count) * sizeof(TH));
+
+			return node;
+		}
+
+		//Replaces a key list ending in the file hash by the root of its tree, write(node) stores a node below the root and returns its key.
+		//Returns false when the list stays flat.
+		//
+		template < typename TH, typename F > bool Build(d8u::sse_vector& list, F&& write, size_t _FANOUT = FANOUT)
+		{
+			auto keys = (const TH*)list.data();
+			uint64_t count = list.size() / sizeof(TH) - 1;
+
+			if (list.size() < sizeof(TH) || count <= _FANOUT)
+				return false;
+
+			TH hash = keys[count];
+
+			std::vector<TH> level(keys, keys + count);
+			uint64_t depth = 0, stride = 1;
+
+			while (level.size() > _FANOUT)
+			{
+				std::vector<TH> parents;
+
+				for (size_t i = 0; i < level.size(); i += _FANOUT)
+				{
+					auto n = std::min<size_t>(_FANOUT, level.size() - i);
+					auto node = Node(Header{ depth, std::min<uint64_t>(stride * _FANOUT, count - i * stride), stride, 0 }, level.data() + i, n, (const TH*)nullptr);
+
+					parents.push_back(write(node));
+				}
+
+				level = std::move(parents);
+				depth++;
+				stride *= _FANOUT;
+			}
+
+			list = Node(Header{ depth, count, stride, 1 }, level.data(), level.size(), &hash);
+
+			return true;
+		}
+
+		//Data key at index of a tree, fetch(key) returns a node as shared_ptr<const sse_vector>. Only the nodes on the way down are fetched.
+		//
+		template < typename TH, typename F > TH Locate(gsl::span<TH> root, uint64_t index, F&& fetch)
+		{
+			std::shared_ptr<const d8u::sse_vector> node;
+			auto keys = root;
+
+			for (;;)
+			{
+				auto header = Read(keys);
+				auto children = Children(keys);
+
+				auto child = index / header.stride;
+
+				if (child >= children.size())
+					throw std::runtime_error("Malformed Key Tree");
+
+				if (!header.level)
+					return children[child];
+
+				index %= header.stride;
+				node = fetch(children[child]);
+
+				if (node->size() % sizeof(TH) != 0)
+					throw std::runtime_error("Malformed Key Tree");
+
+				keys = gsl::span<TH>((TH*)node->data(), node->size() / sizeof(TH));
+
+				if (!Is(keys))
+					throw std::runtime_error("Malformed Key Tree");
+			}
+		}
+	}
+}
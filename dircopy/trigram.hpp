@@ -0,0 +1,401 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <iterator>
+#include <queue>
+#include <memory>
+#include <random>
+#include <stdexcept>
+
+#include "../gsl-lite.hpp"
+#include "../mio.hpp"
+
+#include "delta.hpp"
+
+namespace dircopy
+{
+	namespace trigram
+	{
+		using gsl::span;
+
+		//ASCII case folded, names are matched the same way by the verifying search:
+		//
+		inline uint8_t fold(uint8_t c)
+		{
+			return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		}
+
+		inline std::vector<uint32_t> grams(std::string_view name)
+		{
+			std::vector<uint32_t> result;
+
+			if (name.size() < 3)
+				return result;
+
+			result.reserve(name.size() - 2);
+
+			for (size_t i = 0; i + 2 < name.size(); i++)
+				result.push_back((uint32_t)fold(name[i]) << 16 | (uint32_t)fold(name[i + 1]) << 8 | (uint32_t)fold(name[i + 2]));
+
+			std::sort(result.begin(), result.end());
+			result.erase(std::unique(result.begin(), result.end()), result.end());
+
+			return result;
+		}
+
+		//Posting lists of folder database record pointers per trigram of the lowercase name.
+		//Pairs are sorted in memory up to MEMORY, larger databases are sorted in runs and merged like mark's Sorter.
+		//Saved as: Header, grams ( u32, padded to 8 ), starts ( u64, grams + 1 ), postings ( u64 )
+		//
+
+		class Index
+		{
+			static constexpr uint64_t MAGIC = 0x31304952544c4344; //DCLTRI01
+
+			struct Header
+			{
+				uint64_t magic;
+				uint64_t grams;
+				uint64_t postings;
+			};
+
+			std::vector<uint32_t> _grams;
+			std::vector<uint64_t> _starts;
+			std::vector<uint64_t> _postings;
+
+			std::string temporary;
+
+			mio::mmap_source map;
+
+			span<const uint32_t> gram_list;
+			span<const uint64_t> starts;
+			span<const uint64_t> postings;
+
+			static uint64_t padded(uint64_t grams) { return (grams * sizeof(uint32_t) + 7) / 8 * 8; }
+
+			bool open(const std::string& path)
+			{
+				if (!std::filesystem::exists(path) || std::filesystem::file_size(path) < sizeof(Header))
+					return false;
+
+				map = mio::mmap_source(path);
+
+				auto h = (const Header*)map.data();
+
+				if (h->magic != MAGIC || map.size() != sizeof(Header) + padded(h->grams) + (h->grams + 1 + h->postings) * sizeof(uint64_t))
+				{
+					map.unmap();
+					return false;
+				}
+
+				auto base = (const uint8_t*)map.data() + sizeof(Header);
+
+				gram_list = span<const uint32_t>((const uint32_t*)base, h->grams);
+				starts = span<const uint64_t>((const uint64_t*)(base + padded(h->grams)), h->grams + 1);
+				postings = span<const uint64_t>((const uint64_t*)(base + padded(h->grams)) + h->grams + 1, h->postings);
+
+				return true;
+			}
+
+			//Header, grams and starts, the postings follow:
+			//
+			void head(std::ofstream& output, uint64_t count)
+			{
+				Header h{ MAGIC, _grams.size(), count };
+				uint64_t zero = 0;
+
+				output.write((const char*)&h, sizeof(h));
+				output.write((const char*)_grams.data(), _grams.size() * sizeof(uint32_t));
+				output.write((const char*)&zero, padded(_grams.size()) - _grams.size() * sizeof(uint32_t));
+				output.write((const char*)_starts.data(), _starts.size() * sizeof(uint64_t));
+			}
+
+			void save(const std::string& path)
+			{
+				auto partial = path + ".partial";
+
+				{
+					std::ofstream output(partial, std::ios::binary);
+
+					if (!output.is_open())
+						return; //The index still works from memory
+
+					head(output, _postings.size());
+					output.write((const char*)_postings.data(), _postings.size() * sizeof(uint64_t));
+				}
+
+				std::error_code ec;
+				std::filesystem::rename(partial, path, ec);
+
+				if (ec)
+					std::filesystem::remove(partial, ec);
+			}
+
+			//Pairs past the memory limit are sorted into runs next to the index:
+			//
+			using Pair = std::pair<uint32_t, uint64_t>;
+
+			static void spill(std::vector<Pair>& pairs, std::vector<std::string>& runs, const std::string& base)
+			{
+				std::sort(pairs.begin(), pairs.end());
+
+				auto name = base + ".run" + std::to_string(runs.size());
+
+				{
+					std::ofstream output(name, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create trigram run");
+
+					output.write((const char*)pairs.data(), pairs.size() * sizeof(Pair));
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write trigram run");
+				}
+
+				runs.push_back(name);
+				pairs.clear();
+			}
+
+			//Merges the runs into path, only grams and starts are held in memory while postings stream through a side file:
+			//
+			void merge(std::vector<std::string>& runs, const std::string& path)
+			{
+				struct Run
+				{
+					std::ifstream input;
+					Pair head;
+
+					bool Next() { return (bool)input.read((char*)&head, sizeof(Pair)); }
+				};
+
+				std::vector<std::unique_ptr<Run>> inputs;
+
+				using Entry = std::pair<Pair, size_t>;
+				std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+
+				for (auto& r : runs)
+				{
+					inputs.push_back(std::make_unique<Run>());
+					inputs.back()->input.open(r, std::ios::binary);
+
+					if (!inputs.back()->input.is_open())
+						throw std::runtime_error("Failed to open trigram run");
+
+					if (inputs.back()->Next())
+						heap.push(std::make_pair(inputs.back()->head, inputs.size() - 1));
+				}
+
+				auto side = path + ".postings";
+				uint64_t count = 0;
+
+				{
+					std::ofstream output(side, std::ios::binary);
+
+					if (!output.is_open())
+						throw std::runtime_error("Failed to create trigram postings");
+
+					while (heap.size())
+					{
+						auto [pair, i] = heap.top();
+						heap.pop();
+
+						if (!count || pair.first != _grams.back())
+						{
+							_grams.push_back(pair.first);
+							_starts.push_back(count);
+						}
+
+						output.write((const char*)&pair.second, sizeof(uint64_t));
+						count++;
+
+						if (inputs[i]->Next())
+							heap.push(std::make_pair(inputs[i]->head, i));
+					}
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write trigram postings");
+				}
+
+				_starts.push_back(count);
+				inputs.clear();
+
+				std::error_code ec;
+				for (auto& r : runs)
+					std::filesystem::remove(r, ec);
+
+				auto partial = path + ".partial";
+
+				{
+					std::ofstream output(partial, std::ios::binary);
+					std::ifstream input(side, std::ios::binary);
+
+					if (!output.is_open() || !input.is_open())
+						throw std::runtime_error("Failed to create trigram index");
+
+					head(output, count);
+
+					if (count)
+						output << input.rdbuf();
+
+					if (!output.good())
+						throw std::runtime_error("Failed to write trigram index");
+				}
+
+				std::filesystem::remove(side, ec);
+				std::filesystem::rename(partial, path);
+
+				_grams = std::vector<uint32_t>();
+				_starts = std::vector<uint64_t>();
+
+				if (!open(path))
+					throw std::runtime_error("Failed to open trigram index");
+			}
+
+		public:
+			//path may be empty, then the index lives in memory or, past MEMORY, in a temporary file:
+			//
+			template < typename DB > Index(DB& db, std::string_view path = "", uint64_t MEMORY = 256 * 1024 * 1024)
+			{
+				if (path.size() && open(std::string(path)))
+					return;
+
+				auto target = std::string(path);
+
+				if (!target.size())
+					target = (std::filesystem::temp_directory_path() / ("dircopy_" + std::to_string(((uint64_t)std::random_device()() << 32) | std::random_device()()) + ".tri")).string();
+
+				auto limit = (size_t)std::max<uint64_t>(MEMORY / sizeof(Pair), 1024);
+
+				std::vector<Pair> pairs;
+				std::vector<std::string> runs;
+
+				pairs.reserve(std::min<size_t>(limit, 1024 * 1024));
+
+				try
+				{
+					db.Iterate([&](uint64_t p)
+					{
+						auto [size, time, name, keys] = db.Record(p);
+
+						if (delta::Path<>::Internal(name))
+							return true;
+
+						for (auto g : grams(name))
+						{
+							pairs.push_back(std::make_pair(g, p));
+
+							if (pairs.size() >= limit)
+								spill(pairs, runs, target);
+						}
+
+						return true;
+					});
+
+					if (runs.size())
+					{
+						spill(pairs, runs, target);
+						merge(runs, target);
+
+						if (!path.size())
+							temporary = target;
+
+						return;
+					}
+				}
+				catch (...)
+				{
+					std::error_code ec;
+					for (auto& r : runs)
+						std::filesystem::remove(r, ec);
+
+					std::filesystem::remove(target + ".postings", ec);
+					std::filesystem::remove(target + ".partial", ec);
+
+					throw;
+				}
+
+				std::sort(pairs.begin(), pairs.end());
+
+				_postings.reserve(pairs.size());
+
+				for (size_t i = 0; i < pairs.size(); i++)
+				{
+					if (i == 0 || pairs[i].first != pairs[i - 1].first)
+					{
+						_grams.push_back(pairs[i].first);
+						_starts.push_back(i);
+					}
+
+					_postings.push_back(pairs[i].second);
+				}
+
+				_starts.push_back(pairs.size());
+
+				gram_list = span<const uint32_t>(_grams.data(), _grams.size());
+				starts = span<const uint64_t>(_starts.data(), _starts.size());
+				postings = span<const uint64_t>(_postings.data(), _postings.size());
+
+				if (path.size())
+					save(std::string(path));
+			}
+
+			~Index()
+			{
+				if (!temporary.size())
+					return;
+
+				map.unmap();
+
+				std::error_code ec;
+				std::filesystem::remove(temporary, ec);
+			}
+
+			//Records whose name contains every trigram of target in ascending pointer order, they still need to be verified.
+			//Targets shorter than a trigram can't be answered, the caller scans instead.
+			//
+			std::vector<uint64_t> Candidates(std::string_view target)
+			{
+				std::vector<span<const uint64_t>> lists;
+
+				for (auto g : grams(target))
+				{
+					auto it = std::lower_bound(gram_list.begin(), gram_list.end(), g);
+
+					if (it == gram_list.end() || *it != g)
+						return {};
+
+					auto i = it - gram_list.begin();
+
+					lists.push_back(span<const uint64_t>(postings.data() + starts[i], starts[i + 1] - starts[i]));
+				}
+
+				if (!lists.size())
+					return {};
+
+				std::sort(lists.begin(), lists.end(), [](auto& l, auto& r) { return l.size() < r.size(); });
+
+				std::vector<uint64_t> result(lists[0].begin(), lists[0].end());
+
+				for (size_t i = 1; i < lists.size() && result.size(); i++)
+				{
+					std::vector<uint64_t> next;
+					next.reserve(result.size());
+
+					std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), std::back_inserter(next));
+
+					result.swap(next);
+				}
+
+				return result;
+			}
+		};
+	}
+}
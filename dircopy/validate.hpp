@@ -2,12 +2,29 @@
 
 #pragma once
 
+#include <bitset>
+#include <cstring>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+#include <set>
+#include <mutex>
+#include <string>
+
 #include "d8u/transform.hpp"
 #include "backup.hpp"
 #include "restore.hpp"
 #include "delta.hpp"
+#include "ledger.hpp"
+#include "schedule.hpp"
 
 #include "d8u/util.hpp"
+#include "d8u/async.hpp"
 
 #include "tdb/legacy.hpp"
 
@@ -59,6 +76,124 @@ namespace dircopy
 			return false;
 		}
 
+		//Blocks already checked during this run:
+		//Open addressing over the block id, a slot is claimed with a CAS on its tag and the full id is kept for an exact compare.
+		//When the table is full Insert reports every id as new, duplicates are validated again rather than skipped.
+		//
+
+		template <typename TH> class Visited
+		{
+			static constexpr uint64_t empty = 0;
+			static constexpr uint64_t busy = 1;
+
+			std::vector<std::atomic<uint64_t>> tags;
+			std::vector<uint8_t> ids;
+
+			std::atomic<size_t> used = 0;
+			size_t mask = 0;
+
+			static uint64_t tag(const TH& id)
+			{
+				uint64_t t;
+				std::memcpy(&t, id.data(), sizeof(t));
+
+				return (t < 2) ? t + 2 : t;
+			}
+
+		public:
+			Visited(uint64_t expected, uint64_t LIMIT = 1024 * 1024 * 1024)
+			{
+				size_t capacity = 1024;
+
+				while (capacity < expected * 2 && (capacity * 2) * (sizeof(TH) + sizeof(uint64_t)) <= LIMIT)
+					capacity *= 2;
+
+				tags = std::vector<std::atomic<uint64_t>>(capacity);
+				ids.resize(capacity * sizeof(TH));
+				mask = capacity - 1;
+			}
+
+			size_t Size() { return used; }
+
+			//Returns false when the id was inserted before:
+			//
+			bool Insert(const TH& id)
+			{
+				auto t = tag(id);
+
+				if (used * 4 >= tags.size() * 3)
+					return true;
+
+				for (size_t i = t & mask, n = 0; n < tags.size(); i = (i + 1) & mask, n++)
+				{
+					auto slot = tags[i].load();
+
+					if (slot == empty)
+					{
+						if (tags[i].compare_exchange_strong(slot, busy))
+						{
+							std::memcpy(ids.data() + i * sizeof(TH), id.data(), sizeof(TH));
+							tags[i] = t;
+							used++;
+
+							return true;
+						}
+					}
+
+					while (slot == busy)
+						slot = tags[i].load();
+
+					if (slot == t && std::memcmp(ids.data() + i * sizeof(TH), id.data(), sizeof(TH)) == 0)
+						return false;
+				}
+
+				return true;
+			}
+		};
+
+		//Wraps a block validator so each unique block is checked once, skipped references count as dblocks:
+		//
+		template <typename TH, typename V> auto once(Visited<TH>& visited, V v)
+		{
+			return [&visited, v](Statistics& stats, TH key, auto& store, const auto& domain)
+			{
+				if (!visited.Insert(key.GetNext()))
+				{
+					stats.atomic.dblocks++;
+					return true;
+				}
+
+				return v(stats, key, store, domain);
+			};
+		}
+
+		//Skips blocks the ledger saw verified at this depth within max_age, successes are recorded.
+		//Blocks skipped this way are counted as items:
+		//
+		template <typename TH, typename V> auto recent(ledger::Ledger<TH>* ledger, V v, uint64_t depth, uint64_t now, uint64_t max_age)
+		{
+			return [ledger, v, depth, now, max_age](Statistics& stats, TH key, auto& store, const auto& domain)
+			{
+				if (!ledger)
+					return v(stats, key, store, domain);
+
+				auto id = key.GetNext();
+
+				if (ledger->Fresh(id, depth, now, max_age))
+				{
+					stats.atomic.items++;
+					return true;
+				}
+
+				if (!v(stats, key, store, domain))
+					return false;
+
+				ledger->Record(id, depth, now);
+
+				return true;
+			};
+		}
+
 		//TODO add parallel, see restore::file for template
 		template <typename TH, typename S, typename D, typename V> bool core_file(Statistics& stats, TH file_key, S& store, const D& domain, V v, size_t P = 1)
 		{
@@ -82,15 +217,31 @@ namespace dircopy
 				if (file_record.size() % sizeof(TH) != 0)
 					return false;
 
-				auto count = file_record.size() / sizeof(TH);
+				auto list = span<TH>((TH*)file_record.data(), file_record.size() / sizeof(TH));
+
+				//Nodes of a key tree are checked like key lists of their own:
+				//
+				if (tree::Is(list) && tree::Read(list).level)
+				{
+					for (auto& node : tree::Children(list))
+					{
+						if (!core_file(stats, node, store, domain, v, P))
+							return false;
+					}
+
+					return true;
+				}
+
+				auto keys = tree::Children(list); /*Last hash is the file hash*/
+				auto count = keys.size();
 
 				bool result = true;
 
 				if (P == 1)
 				{
-					for (size_t i = 0; i < count - 1 /*Last hash is the file hash*/; i++)
+					for (size_t i = 0; i < count; i++)
 					{
-						auto key = ((TH*)file_record.data()) + i;
+						auto key = keys.data() + i;
 
 						if (!v(stats, *key, store, domain))
 							return false;
@@ -98,9 +249,9 @@ namespace dircopy
 				}
 				else
 				{
-					for (size_t i = 0; result && i < count - 1 /*Last hash is the file hash*/; i++)
+					for (size_t i = 0; result && i < count; i++)
 					{
-						auto key = ((TH*)file_record.data()) + i;
+						auto key = keys.data() + i;
 
 						fast_wait(stats.atomic.threads, P);
 
@@ -142,41 +293,31 @@ namespace dircopy
 		}
 
 		//todo parallel, see restore::folder
-		template <typename TH, typename S, typename D, typename V> bool core_folder(Statistics &s ,TH folder_key, S& store, const D& domain, V v, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
+		template <typename TH, typename S, typename D, typename V> bool core_folder(Statistics &s ,TH folder_key, S& store, const D& domain, V v, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1, std::string_view ledger_path = "", uint64_t depth = ledger::shallow, uint64_t max_age = 0)
 		{
 			try
 			{
-				auto folder_id = folder_key.GetNext();
-				auto folder_record = store.Read(folder_id);
-
-				if (!validate_block<TH, d8u::sse_vector>(folder_record))
-					return false;
-
-				decode(domain, folder_record, folder_key);
-
-				TH dup_key(domain, folder_record);
+				restore::Database<TH> db(s, folder_key, store, domain, true, true, P);
+				bool res = true;
 
-				if (!std::equal(folder_key.begin(), folder_key.end(), dup_key.begin()))
-					return false;
+				auto folder_stats = db.Statistics(domain);
+				s.direct.target = folder_stats.size;
 
-				auto database = restore::file_memory(s, gsl::span<TH>((TH*)folder_record.data(),folder_record.size()/sizeof(TH)), store, domain, true, true);
+				auto now = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 
-				tdb::MemoryHashmap db(std::move(database));
-				bool res = true;
+				std::unique_ptr<ledger::Ledger<TH>> history;
 
-				{
-					auto [size, time, name, data] = delta::Path<TH>::DecodeRaw(db.FindObject(domain));
+				if (ledger_path.size())
+					history = std::make_unique<ledger::Ledger<TH>>(ledger_path, folder_stats.blocks + folder_stats.files, now, max_age);
 
-					auto stats = (typename delta::Path<TH>::FolderStatistics*)data.data();
-
-					s.direct.target = stats->size;
-				}
+				Visited<TH> visited(folder_stats.blocks + folder_stats.files);
+				auto unique = once(visited, recent(history.get(), v, depth, now, max_age));
 
 				auto file = [&](uint64_t p)
 				{
 					dec_scope lock(s.atomic.files);
 
-					auto [size, time, name, keys] = delta::Path<TH>::Decode(db.GetObject(p));
+					auto [size, time, name, keys] = db.Record(p);
 
 					if (!size)
 						return res;
@@ -186,8 +327,23 @@ namespace dircopy
 						/*if (keys.size() != 1)
 							return res = false;*/
 
-						if (!core_file(s, *keys.data(), store, domain, v,P))
-							return res = false;
+						//A key list seen before covers the same blocks:
+						//
+
+						auto list = keys.data()->GetNext();
+
+						if (!visited.Insert(list))
+							s.atomic.dblocks++;
+						else if (history && history->Fresh(list, depth, now, max_age))
+							s.atomic.items++;
+						else
+						{
+							if (!core_file(s, *keys.data(), store, domain, unique, P))
+								return res = false;
+
+							if (history)
+								history->Record(list, depth, now);
+						}
 					}
 					else
 					{
@@ -199,7 +355,7 @@ namespace dircopy
 							if (&k == keys.end() - 1)
 								break; //Last hash is the file hash
 
-							if (!v(s, k, store, domain))
+							if (!unique(s, k, store, domain))
 								return res = false;
 						}
 					}
@@ -237,14 +393,758 @@ namespace dircopy
 			return false;
 		}
 
-		template <typename TH, typename S, typename D> bool folder2(Statistics &s,const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
+		//With a ledger only blocks not verified within max_age seconds are checked, a max_age of 0 checks everything and refreshes the ledger:
+		//
+
+		template <typename TH, typename S, typename D> bool folder2(Statistics &s,const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1, std::string_view ledger_path = "", uint64_t max_age = 0)
+		{
+			return core_folder<TH>(s, folder_key, store, domain, block<TH,S, D>, BLOCK, THRESHOLD, P, F, ledger_path, ledger::shallow, max_age);
+		}
+
+		template <typename TH, typename S, typename D> bool deep_folder2(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1, std::string_view ledger_path = "", uint64_t max_age = 0)
+		{
+			return core_folder<TH>(s, folder_key, store, domain, deep_block<TH,S, D>, BLOCK, THRESHOLD, P, F, ledger_path, ledger::deep, max_age);
+		}
+
+		//Batched shallow validation:
+		//Block ids are gathered from the folder database and sent 64 at a time with the bulk query backup uses ( _Many1 / _Many2 ).
+		//DEPTH batches are in flight, on_batch(index, ids, bitmap) reports each answer, a clear bit is a missing block.
+		//Key lists of large files are read between pipelines so no read shares the connection with an outstanding batch.
+		//Each unique block is queried once, blocks counts them and dblocks the references skipped.
+		//
+
+		template <typename TH, typename S, typename D, typename ON_BATCH> bool core_batch(Statistics& s, const TH& folder_key, S& store, const D& domain, ON_BATCH&& on_batch, size_t P = 1, size_t DEPTH = 64)
+		{
+			struct Batch
+			{
+				size_t index = 0;
+				std::vector<TH> ids;
+			};
+
+			try
+			{
+				restore::Database<TH> db(s, folder_key, store, domain, true, true, P);
+				std::atomic<bool> res = true;
+
+				auto folder_stats = db.Statistics(domain);
+				s.direct.target = folder_stats.size;
+
+				Visited<TH> visited(folder_stats.blocks + folder_stats.files);
+
+				size_t issued = 0;
+
+				//Runs one batch pipeline over the keys source(push) produces, it is drained before returning:
+				//
+
+				auto run = [&](auto&& source)
+				{
+					d8u::async::Pipeline<Batch, 3> batch_pipeline;
+
+					batch_pipeline.Start([&](auto& prev, auto& next)
+					{
+						Batch batch;
+						batch.index = issued;
+						batch.ids.reserve(64);
+
+						auto submit = [&]()
+						{
+							if (!batch.ids.size())
+								return;
+
+							d8u::sse_vector query(sizeof(TH) * batch.ids.size());
+
+							for (size_t i = 0; i < batch.ids.size(); i++)
+								std::memcpy(query.data() + i * sizeof(TH), batch.ids[i].data(), sizeof(TH));
+
+							store.template _Many1<sizeof(TH)>(query);
+
+							s.atomic.connections++;
+
+							auto index = batch.index + 1;
+							next.Push(std::move(batch), DEPTH);
+
+							batch = Batch();
+							batch.index = index;
+							batch.ids.reserve(64);
+						};
+
+						//Returns false for a block already queried:
+						//
+
+						auto push = [&](const TH& key)
+						{
+							if (!visited.Insert(key.GetNext()))
+							{
+								s.atomic.dblocks++;
+								return false;
+							}
+
+							batch.ids.push_back(key.GetNext());
+							s.atomic.blocks++;
+
+							if (batch.ids.size() == 64)
+								submit();
+
+							return true;
+						};
+
+						source(push);
+
+						submit();
+
+						issued = batch.index;
+					});
+
+					batch_pipeline.Stream([&](auto&& batch, auto& next)
+					{
+						auto bitmap = std::bitset<64>(store._Many2());
+
+						s.atomic.connections--;
+
+						for (size_t i = 0; i < batch.ids.size(); i++)
+						{
+							if (!bitmap[i])
+								res = false;
+						}
+
+						on_batch(batch.index, batch.ids, bitmap);
+
+						return true;
+					}, 1 /*Answers arrive in submission order*/);
+				};
+
+				//Key lists are metadata, they are queued like blocks and read once no batch is outstanding:
+				//
+
+				std::vector<TH> lists;
+
+				run([&](auto& push)
+				{
+					db.Iterate([&](uint64_t p)
+					{
+						auto [size, time, name, keys] = db.Record(p);
+
+						if (!size)
+							return true;
+
+						if (keys.size() == 1)
+						{
+							//A key list seen before covers the same blocks:
+							//
+
+							if (push(*keys.data()))
+								lists.push_back(*keys.data());
+						}
+						else
+						{
+							if (keys.size() <= 1)
+								return (bool)(res = false);
+
+							for (size_t i = 0; i + 1 < keys.size() /*Last hash is the file hash*/; i++)
+								push(keys[i]);
+						}
+
+						s.atomic.read += size;
+
+						return true;
+					});
+				});
+
+				std::vector<TH> ids;
+
+				for (size_t j = 0; j < lists.size(); j++)
+				{
+					try
+					{
+						auto list = restore::list(s, lists[j], store, domain, true, [&](const TH& node) { ids.push_back(node); });
+
+						for (size_t i = 0; i + 1 < list.size() / sizeof(TH) /*Last hash is the file hash*/; i++)
+							ids.push_back(((TH*)list.data())[i]);
+					}
+					catch (...)
+					{
+						res = false;
+					}
+
+					if (ids.size() >= 64 * 1024 || j + 1 == lists.size())
+					{
+						run([&](auto& push)
+						{
+							for (auto& id : ids)
+								push(id);
+						});
+
+						ids.clear();
+					}
+				}
+
+				return res;
+			}
+			catch (...) {}
+
+			return false;
+		}
+
+		template <typename TH, typename S, typename D> bool batch_folder2(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t P = 1, size_t DEPTH = 64)
+		{
+			return core_batch(s, folder_key, store, domain, [](auto index, auto& ids, auto bitmap) {}, P, DEPTH);
+		}
+
+		//Validation across several snapshots:
+		//Pass 1 checks the union of their blocks, each unique block once.
+		//Pass 2 only runs when something failed, it maps the failed blocks back to on_failure(snapshot index, file name) for every file referencing them.
+		//
+
+		template <typename TH, typename S, typename D, typename V, typename ON_FAILURE> bool core_many(Statistics& s, const std::vector<TH>& folder_keys, S& store, const D& domain, V v, ON_FAILURE&& on_failure, size_t P = 1)
+		{
+			std::vector<std::unique_ptr<restore::Database<TH>>> dbs;
+			uint64_t expected = 0;
+
+			for (auto& k : folder_keys)
+			{
+				dbs.push_back(std::make_unique<restore::Database<TH>>(s, k, store, domain, true, true, P));
+
+				auto folder_stats = dbs.back()->Statistics(domain);
+
+				s.direct.target += folder_stats.size;
+				expected += folder_stats.blocks + folder_stats.files;
+			}
+
+			Visited<TH> visited(expected);
+
+			std::mutex failed_lock;
+			std::set<std::string> failed;
+			bool malformed = false;
+
+			auto fail = [&](const TH& id)
+			{
+				std::lock_guard<std::mutex> guard(failed_lock);
+				failed.insert(std::string((const char*)id.data(), sizeof(TH)));
+			};
+
+			auto is_failed = [&](const TH& id)
+			{
+				return failed.find(std::string((const char*)id.data(), sizeof(TH))) != failed.end();
+			};
+
+			//Calls f(key) for every block below a key list, tree nodes included. Returns false when the key list can't be read:
+			//
+			auto listed = [&](const TH& key, auto&& f)
+			{
+				try
+				{
+					auto list = restore::list(s, key, store, domain, true, f);
+
+					for (size_t i = 0; i + 1 < list.size() / sizeof(TH) /*Last hash is the file hash*/; i++)
+						f(((TH*)list.data())[i]);
+				}
+				catch (...)
+				{
+					return false;
+				}
+
+				return true;
+			};
+
+			//Calls f(key) for every block of a file, key lists included:
+			//
+			auto blocks = [&](auto& keys, auto&& f)
+			{
+				if (keys.size() == 1)
+				{
+					f(*keys.data());
+
+					return listed(*keys.data(), f);
+				}
+				else
+				{
+					for (size_t i = 0; i + 1 < keys.size() /*Last hash is the file hash*/; i++)
+						f(keys[i]);
+				}
+
+				return true;
+			};
+
+			{
+				d8u::async::Pipeline<TH, 2> block_pipeline;
+
+				block_pipeline.Start([&](auto& prev, auto& next)
+				{
+					for (size_t i = 0; i < dbs.size(); i++)
+					{
+						dbs[i]->Iterate([&](uint64_t p)
+						{
+							auto [size, time, name, keys] = dbs[i]->Record(p);
+
+							if (!size)
+								return true;
+
+							if (!keys.size())
+							{
+								malformed = true;
+								on_failure(i, name);
+								return true;
+							}
+
+							auto check = [&](const TH& key)
+							{
+								if (!visited.Insert(key.GetNext()))
+								{
+									s.atomic.dblocks++;
+									return false;
+								}
+
+								next.Push(TH(key), 4096);
+
+								return true;
+							};
+
+							//A key list seen in an earlier file or snapshot has its blocks queued already, it isn't read again:
+							//
+
+							bool readable = true;
+
+							if (keys.size() == 1)
+							{
+								if (check(*keys.data()))
+									readable = listed(*keys.data(), check);
+							}
+							else
+								readable = blocks(keys, check);
+
+							if (!readable)
+								fail(keys.data()->GetNext());
+
+							s.atomic.read += size;
+
+							return true;
+						});
+					}
+				});
+
+				block_pipeline.Stream([&](auto&& key, auto& next)
+				{
+					if (!v(s, key, store, domain))
+						fail(key.GetNext());
+
+					return true;
+				}, P);
+			}
+
+			if (!failed.size())
+				return !malformed;
+
+			for (size_t i = 0; i < dbs.size(); i++)
+			{
+				dbs[i]->Iterate([&](uint64_t p)
+				{
+					auto [size, time, name, keys] = dbs[i]->Record(p);
+
+					if (!size || !keys.size())
+						return true;
+
+					bool bad = keys.size() == 1 && is_failed(keys.data()->GetNext());
+
+					if (!bad)
+						blocks(keys, [&](const TH& key) { bad = bad || is_failed(key.GetNext()); });
+
+					if (bad)
+						on_failure(i, name);
+
+					return true;
+				});
+			}
+
+			return false;
+		}
+
+		template <typename TH, typename S, typename D, typename ON_FAILURE> bool many2(Statistics& s, const std::vector<TH>& folder_keys, S& store, const D& domain, bool deep, ON_FAILURE&& on_failure, size_t P = 1)
+		{
+			try
+			{
+				if (deep)
+					return core_many(s, folder_keys, store, domain, deep_block<TH, S, D>, on_failure, P);
+				else
+					return core_many(s, folder_keys, store, domain, block<TH, S, D>, on_failure, P);
+			}
+			catch (...) {}
+
+			return false;
+		}
+
+		//Whole file validation:
+		//Runs the restore pipeline ( Fetch -> Decode -> Hash ) into a sink that discards the data, every block key and every file hash is checked.
+		//Unlike deep_folder2 shared blocks are decoded once per file that references them, the file hash needs them all.
+		//
+
+		class Discard
 		{
-			return core_folder<TH>(s, folder_key, store, domain, block<TH,S, D>, BLOCK, THRESHOLD, P, F);
+		public:
+			struct Output
+			{
+				void write(const char*, size_t) { }
+			};
+
+			void Empty(std::string_view name) { }
+
+			Output Open(std::string_view name) { return Output(); }
+		};
+
+		template <typename TH, typename S, typename D> bool stream_folder2(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t P = 1, size_t F = 1, size_t SMALL = 16)
+		{
+			try
+			{
+				restore::Database<TH> db(s, folder_key, store, domain, true, true, P);
+				Discard sink;
+
+				s.direct.target = db.Statistics(domain).size;
+
+				restore::stream_folder<TH>(s, db, sink, store, domain, true, true, P, std::max<size_t>(F, 1), SMALL);
+
+				return true;
+			}
+			catch (...) {}
+
+			return false;
 		}
 
-		template <typename TH, typename S, typename D> bool deep_folder2(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
+		//Sampled deep validation:
+		//A uniform sample of unique blocks is deep validated and the corrupt fraction is bounded at the requested confidence.
+		//Blocks can be stratified by the size or age of the first file referencing them, each stratum gets an equal share of the sample.
+		//The bound on the whole folder is Bonferroni adjusted across strata. P threads fetch key lists of large files and validate the sample.
+		//
+
+		enum class Strata
+		{
+			none,
+			size,
+			age
+		};
+
+		struct Estimate
 		{
-			return core_folder<TH>(s, folder_key, store, domain, deep_block<TH,S, D>, BLOCK, THRESHOLD, P, F);
+			uint64_t population = 0;
+			uint64_t sampled = 0;
+			uint64_t failed = 0;
+
+			double upper = 0;
+		};
+
+		struct Sampled
+		{
+			Estimate total;
+			std::vector<Estimate> strata;
+		};
+
+		//Clopper-Pearson upper bound, the largest p where failed or fewer corrupt blocks in sampled draws still has probability 1 - confidence:
+		//
+		double clopper_pearson(uint64_t sampled, uint64_t failed, double confidence)
+		{
+			if (!sampled)
+				return 1;
+
+			if (failed >= sampled)
+				return 1;
+
+			auto cdf = [&](double p)
+			{
+				double sum = 0;
+
+				for (uint64_t i = 0; i <= failed; i++)
+				{
+					auto log_term = std::lgamma((double)sampled + 1) - std::lgamma((double)i + 1) - std::lgamma((double)(sampled - i) + 1)
+						+ i * std::log(p) + (sampled - i) * std::log1p(-p);
+
+					sum += std::exp(log_term);
+				}
+
+				return sum;
+			};
+
+			double low = (double)failed / sampled, high = 1;
+
+			for (size_t i = 0; i < 64; i++)
+			{
+				auto mid = (low + high) / 2;
+
+				if (cdf(mid) > 1 - confidence)
+					low = mid;
+				else
+					high = mid;
+			}
+
+			return high;
+		}
+
+		template <typename TH, typename S, typename D> Sampled core_sample(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t SAMPLES = 4096, double confidence = 0.99, Strata strata = Strata::none, uint64_t seed = 0, size_t P = 1, size_t STRATA = 4)
+		{
+			struct Candidate
+			{
+				TH key;
+				uint64_t location;
+				size_t stratum;
+			};
+
+			restore::Database<TH> db(s, folder_key, store, domain, true, true, P);
+
+			auto folder_stats = db.Statistics(domain);
+			s.direct.target = folder_stats.size;
+
+			if (strata == Strata::none)
+				STRATA = 1;
+
+			//Age strata are equal width between the oldest and newest file:
+			//
+
+			uint64_t oldest = (uint64_t)-1, newest = 0;
+
+			if (strata == Strata::age)
+			{
+				db.Iterate([&](uint64_t p)
+				{
+					auto [size, time, name, keys] = db.Record(p);
+
+					if (size)
+					{
+						oldest = std::min(oldest, (uint64_t)time);
+						newest = std::max(newest, (uint64_t)time);
+					}
+
+					return true;
+				});
+			}
+
+			auto stratum = [&](uint64_t size, uint64_t time) -> size_t
+			{
+				switch (strata)
+				{
+				case Strata::size:
+				{
+					//Powers of 16 from 64KB, the last stratum holds the rest:
+					//
+
+					size_t i = 0;
+					for (uint64_t limit = 64 * 1024; i + 1 < STRATA && size >= limit; limit *= 16)
+						i++;
+
+					return i;
+				}
+				case Strata::age:
+					if (newest <= oldest)
+						return 0;
+
+					return std::min(STRATA - 1, (size_t)((double)(time - oldest) / (double)(newest - oldest + 1) * STRATA));
+				default:
+					return 0;
+				}
+			};
+
+			Sampled result;
+			result.strata.resize(STRATA);
+
+			std::vector<std::vector<Candidate>> reservoirs(STRATA);
+			auto share = std::max<size_t>(1, SAMPLES / STRATA);
+
+			std::mt19937_64 random(seed ? seed : std::random_device()());
+
+			Visited<TH> visited(folder_stats.blocks + folder_stats.files);
+
+			auto offer = [&](const TH& key, size_t i)
+			{
+				if (!visited.Insert(key.GetNext()))
+					return;
+
+				auto& r = reservoirs[i];
+				auto seen = ++result.strata[i].population;
+
+				if (r.size() < share)
+					r.push_back(Candidate{ key, 0, i });
+				else
+				{
+					auto j = std::uniform_int_distribution<uint64_t>(0, seen - 1)(random);
+
+					if (j < share)
+						r[j] = Candidate{ key, 0, i };
+				}
+			};
+
+			std::atomic<bool> malformed = false;
+
+			//Key lists of large files are fetched afterwards by P threads, they are offered in record order so a seed still gives the same sample:
+			//
+
+			std::vector<std::pair<TH, size_t>> large;
+
+			db.Iterate([&](uint64_t p)
+			{
+				auto [size, time, name, keys] = db.Record(p);
+
+				if (!size)
+					return true;
+
+				auto i = stratum(size, time);
+
+				if (keys.size() == 1)
+				{
+					offer(*keys.data(), i);
+					large.push_back(std::make_pair(*keys.data(), i));
+				}
+				else if (keys.size() > 1)
+				{
+					for (size_t k = 0; k + 1 < keys.size() /*Last hash is the file hash*/; k++)
+						offer(keys[k], i);
+				}
+				else
+					malformed = true;
+
+				return true;
+			});
+
+			struct Listed
+			{
+				d8u::sse_vector list;
+				std::vector<TH> nodes;
+			};
+
+			auto window = std::max<size_t>(P, 1) * 4;
+
+			for (size_t start = 0; start < large.size(); start += window)
+			{
+				auto count = std::min(window, large.size() - start);
+
+				std::vector<Listed> lists(count);
+				std::atomic<size_t> next_list = 0;
+
+				auto fetch = [&]()
+				{
+					for (size_t j = next_list++; j < count; j = next_list++)
+					{
+						try
+						{
+							lists[j].list = restore::list(s, large[start + j].first, store, domain, true, [&](const TH& node) { lists[j].nodes.push_back(node); });
+						}
+						catch (...)
+						{
+							malformed = true;
+						}
+					}
+				};
+
+				if (P <= 1)
+					fetch();
+				else
+				{
+					std::vector<std::thread> pool;
+
+					for (size_t i = 0; i < std::min(P, count); i++)
+						pool.emplace_back(fetch);
+
+					for (auto& t : pool)
+						t.join();
+				}
+
+				for (size_t j = 0; j < count; j++)
+				{
+					auto i = large[start + j].second;
+
+					for (auto& node : lists[j].nodes)
+						offer(node, i);
+
+					for (size_t k = 0; k + 1 < lists[j].list.size() / sizeof(TH) /*Last hash is the file hash*/; k++)
+						offer(((TH*)lists[j].list.data())[k], i);
+				}
+			}
+
+			std::vector<Candidate> sample;
+
+			for (auto& r : reservoirs)
+				sample.insert(sample.end(), r.begin(), r.end());
+
+			//Read in store locality order where the store exposes it:
+			//
+
+			if constexpr (schedule::has_locate<S, TH>::value)
+			{
+				for (auto& c : sample)
+					c.location = store.Locate(c.key.GetNext());
+
+				std::sort(sample.begin(), sample.end(), [](const auto& l, const auto& r) { return l.location < r.location; });
+			}
+
+			std::vector<std::atomic<uint64_t>> failed(STRATA);
+			std::atomic<size_t> next = 0;
+
+			auto worker = [&]()
+			{
+				for (size_t i = next++; i < sample.size(); i = next++)
+				{
+					if (!deep_block(s, sample[i].key, store, domain))
+						failed[sample[i].stratum]++;
+				}
+			};
+
+			if (P <= 1)
+				worker();
+			else
+			{
+				std::vector<std::thread> pool;
+
+				for (size_t i = 0; i < P; i++)
+					pool.emplace_back(worker);
+
+				for (auto& t : pool)
+					t.join();
+			}
+
+			//Each stratum reports its own bound at confidence. The total weights stratum bounds by their share of the population,
+			//those are taken at 1 - (1 - confidence) / STRATA so all hold together and the total keeps the requested confidence:
+			//
+
+			std::vector<double> joint(STRATA);
+
+			for (size_t i = 0; i < STRATA; i++)
+			{
+				auto& e = result.strata[i];
+
+				e.sampled = reservoirs[i].size();
+				e.failed = failed[i];
+				e.upper = clopper_pearson(e.sampled, e.failed, confidence);
+
+				joint[i] = (STRATA > 1) ? clopper_pearson(e.sampled, e.failed, 1 - (1 - confidence) / STRATA) : e.upper;
+
+				result.total.population += e.population;
+				result.total.sampled += e.sampled;
+				result.total.failed += e.failed;
+			}
+
+			if (malformed)
+				result.total.failed++;
+
+			for (size_t i = 0; i < STRATA; i++)
+			{
+				auto& e = result.strata[i];
+
+				if (result.total.population && e.population)
+					result.total.upper += joint[i] * e.population / result.total.population;
+			}
+
+			if (malformed)
+				result.total.upper = 1;
+
+			return result;
+		}
+
+		template <typename TH, typename S, typename D> std::pair<bool, Sampled> sample_folder2(Statistics& s, const TH& folder_key, S& store, const D& domain, size_t SAMPLES = 4096, double confidence = 0.99, Strata strata = Strata::none, uint64_t seed = 0, size_t P = 1)
+		{
+			try
+			{
+				auto result = core_sample(s, folder_key, store, domain, SAMPLES, confidence, strata, seed, P);
+
+				return std::make_pair(result.total.failed == 0, result);
+			}
+			catch (...) {}
+
+			return std::make_pair(false, Sampled());
 		}
 
 		template <typename TH, typename S, typename D> std::pair<bool, Direct> folder(const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
@@ -254,6 +1154,20 @@ namespace dircopy
 			return std::make_pair(core_folder<TH>(s,folder_key, store, domain, block<TH,S, D>, BLOCK, THRESHOLD,P,F),s.direct);
 		}
 
+		template <typename TH, typename S, typename D> std::pair<bool, Direct> batch_folder(const TH& folder_key, S& store, const D& domain, size_t P = 1, size_t DEPTH = 64)
+		{
+			Statistics s;
+
+			return std::make_pair(batch_folder2<TH>(s, folder_key, store, domain, P, DEPTH), s.direct);
+		}
+
+		template <typename TH, typename S, typename D> std::pair<bool, Direct> stream_folder(const TH& folder_key, S& store, const D& domain, size_t P = 1, size_t F = 1)
+		{
+			Statistics s;
+
+			return std::make_pair(stream_folder2<TH>(s, folder_key, store, domain, P, F), s.direct);
+		}
+
 		template <typename TH, typename S, typename D> std::pair<bool, Direct> deep_folder(const TH& folder_key, S& store, const D& domain, size_t BLOCK = 1024 * 1024, size_t THRESHOLD = 128 * 1024 * 1024, size_t P = 1, size_t F = 1)
 		{
 			Statistics s;